@@ -2,10 +2,35 @@
 #define CWD "cwd: "
 #define CURSR " > "
 #define EMPTY "   "
+#define SELMARK '+'
+#define ONLYMARK '!' /* Compare mark for entries in one pane only */
+#define DIFFMARK '~' /* Compare mark for entries that differ */
+#define GONEMARK '-' /* Compare mark for entries on the other side only */
+#define NEWMARK '*' /* Entries new since the last visit, changed get '~' */
 
 int mtimeorder = 0; /* Set to 1 to sort by time modified */
+int showstats = 0; /* Set to 1 to show scan and render metrics */
 int idletimeout = 0; /* Screensaver timeout in seconds, 0 to disable */
 char *idlecmd = "rain"; /* The screensaver program */
+int maxjobs = 4; /* Maximum number of background jobs */
+int nworkers = 4; /* Processes a job may split its work among */
+int showhash = 0; /* Set to 1 to show file checksums */
+int showlinks = 1; /* Set to 0 to hide symlink targets */
+int showowner = 0; /* Set to 1 to show permissions, owner and group */
+char *cksumfile = ".noice_cksums"; /* Checksum cache, relative to $HOME */
+char *snapdir = ".noice_snaps"; /* Directory snapshots, relative to $HOME */
+char *visitdir = ".noice_visits"; /* Listings of the last visits, too */
+int nvisits = 256; /* Directories remembered for new marks, 0 to disable */
+int topk = 100; /* Files kept in the largest and recent views */
+char *scansock = NULL; /* Socket of noiced(1), NULL to always scan here */
+char *remotefile = NULL; /* FIFO or lircd(8) socket with remote buttons */
+char *ctlsock = NULL; /* Socket for the control API, NULL to disable */
+int syncpanes = 1; /* Set to 0 to scroll split panes on their own */
+int packmin = 100000; /* Entries from which names are front-coded, 0 never */
+unsigned long memcap = 0; /* Bytes a listing may hold before it spills, 0 none */
+char *scanlog = NULL; /* Log of how listings were read, relative to $HOME */
+int statwait = 2000; /* Milliseconds a stat(2) may hang, 0 waits */
+int scanwait = 5000; /* Milliseconds all of a listing's may take, 0 waits */
 
 struct assoc assocs[] = {
 	{ "\\.(avi|mp4|mkv|mp3|ogg|flac|mov)$", "mplayer" },
@@ -16,6 +41,45 @@ struct assoc assocs[] = {
 	{ ".", "less" },
 };
 
+/*
+ * How to read a directory by the f_type statfs(2) gives for it.  The
+ * first match wins, 0 matches any.
+ */
+struct fspolicy fspolicies[] = {
+	{ 0x6969,     SCAN_PARALLEL }, /* NFS */
+	{ 0xff534d42, SCAN_PARALLEL }, /* CIFS */
+	{ 0xfe534d42, SCAN_PARALLEL }, /* SMB2 */
+	{ 0x65735546, SCAN_NOSTAT },   /* FUSE */
+	{ 0,          SCAN_SERIAL },
+};
+
+/*
+ * Listings under these paths take the attributes the client has cached,
+ * see AT_STATX_DONT_SYNC in statx(2).  Meant for network mounts.
+ */
+struct mountpolicy mounts[] = {
+	{ "/net",             1 },
+};
+
+/* Remote control buttons by LIRC name, bound as the keys given */
+struct button buttons[] = {
+	{ "KEY_UP",           KEY_UP },
+	{ "KEY_DOWN",         KEY_DOWN },
+	{ "KEY_LEFT",         KEY_LEFT },
+	{ "KEY_RIGHT",        KEY_RIGHT },
+	{ "KEY_OK",           KEY_ENTER },
+	{ "KEY_ENTER",        KEY_ENTER },
+	{ "KEY_BACK",         KEY_BACKSPACE },
+	{ "KEY_PAGEUP",       KEY_PPAGE },
+	{ "KEY_PAGEDOWN",     KEY_NPAGE },
+	{ "KEY_CHANNELUP",    KEY_PPAGE },
+	{ "KEY_CHANNELDOWN",  KEY_NPAGE },
+	{ "KEY_HOME",         KEY_HOME },
+	{ "KEY_END",          KEY_END },
+	{ "KEY_SELECT",       ' ' },
+	{ "KEY_EXIT",         'q' },
+};
+
 struct key bindings[] = {
 	/* Quit */
 	{ 'q',            SEL_QUIT },
@@ -62,6 +126,40 @@ struct key bindings[] = {
 	/* Toggle sort by time */
 	{ 't',            SEL_MTIME },
 	{ CONTROL('L'),   SEL_REDRAW },
+	/* Toggle metrics */
+	{ 'i',            SEL_STATS },
+	/* Copy or move in the background */
+	{ 'C',            SEL_COPY },
+	{ 'M',            SEL_MOVE },
+	{ 'D',            SEL_DELETE },
+	/* Cancel the latest job */
+	{ 'K',            SEL_JOBKILL },
+	/* Select entries */
+	{ ' ',            SEL_MARK },
+	{ 'v',            SEL_MARKRANGE },
+	{ 'a',            SEL_MARKALL },
+	{ 'u',            SEL_MARKCLR },
+	/* Checksum in the background, toggle the checksum column */
+	{ 'H',            SEL_HASH },
+	{ 'x',            SEL_HASHCOL },
+	{ 'o',            SEL_OWNERCOL },
+	/* Find duplicate files under the current directory */
+	{ 'F',            SEL_DUPS },
+	/* Largest and most recently modified files under it */
+	{ 'L',            SEL_LARGEST },
+	{ 'R',            SEL_RECENT },
+	/* Tabs */
+	{ CONTROL('T'),   SEL_TABNEW },
+	{ CONTROL('W'),   SEL_TABCLOSE },
+	{ '\t',           SEL_TABNEXT },
+	{ KEY_BTAB,       SEL_TABPREV },
+	/* Two tabs side by side, mark what differs between them */
+	{ 'w',            SEL_SPLIT },
+	{ '=',            SEL_COMPARE },
+	/* Compare with the other pane or the snapshot, deep with 'Y' */
+	{ 'S',            SEL_SNAP },
+	{ 'y',            SEL_DIFF },
+	{ 'Y',            SEL_DIFFTREE },
 	/* Run command */
 	{ 'z',            SEL_RUN, "top" },
 	{ '!',            SEL_RUN, "sh", "SHELL" },
@@ -0,0 +1,138 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * Streaming xxHash64.  Fast enough to be bound by the disk and not
+ * cryptographic; it is meant for verifying and comparing files.
+ */
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* Little endian loads that compile to plain loads where possible */
+static uint64_t
+rd64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	    (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	    (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint64_t
+rd32(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	    (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
+
+static uint64_t
+xround(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = ROTL(acc, 31);
+	return acc * P1;
+}
+
+static uint64_t
+xmerge(uint64_t acc, uint64_t v)
+{
+	acc ^= xround(0, v);
+	return acc * P1 + P4;
+}
+
+static void
+xstripe(unsigned long long *v, const unsigned char *p)
+{
+	v[0] = xround(v[0], rd64(p));
+	v[1] = xround(v[1], rd64(p + 8));
+	v[2] = xround(v[2], rd64(p + 16));
+	v[3] = xround(v[3], rd64(p + 24));
+}
+
+void
+hashinit(struct hash *h, unsigned long long seed)
+{
+	h->v[0] = seed + P1 + P2;
+	h->v[1] = seed + P2;
+	h->v[2] = seed;
+	h->v[3] = seed - P1;
+	h->total = 0;
+	h->len = 0;
+}
+
+void
+hashupdate(struct hash *h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+	size_t fill;
+
+	h->total += len;
+	if (h->len + len < sizeof(h->mem)) {
+		memcpy(h->mem + h->len, p, len);
+		h->len += len;
+		return;
+	}
+	if (h->len > 0) {
+		fill = sizeof(h->mem) - h->len;
+		memcpy(h->mem + h->len, p, fill);
+		xstripe(h->v, h->mem);
+		p += fill;
+		h->len = 0;
+	}
+	for (; end - p >= 32; p += 32)
+		xstripe(h->v, p);
+	if (p < end) {
+		memcpy(h->mem, p, end - p);
+		h->len = end - p;
+	}
+}
+
+unsigned long long
+hashfinal(struct hash *h)
+{
+	const unsigned char *p = h->mem, *end = p + h->len;
+	uint64_t acc;
+
+	if (h->total >= 32) {
+		acc = ROTL(h->v[0], 1) + ROTL(h->v[1], 7) +
+		    ROTL(h->v[2], 12) + ROTL(h->v[3], 18);
+		acc = xmerge(acc, h->v[0]);
+		acc = xmerge(acc, h->v[1]);
+		acc = xmerge(acc, h->v[2]);
+		acc = xmerge(acc, h->v[3]);
+	} else {
+		acc = h->v[2] + P5;
+	}
+	acc += h->total;
+
+	for (; end - p >= 8; p += 8) {
+		acc ^= xround(0, rd64(p));
+		acc = ROTL(acc, 27) * P1 + P4;
+	}
+	if (end - p >= 4) {
+		acc ^= rd32(p) * P1;
+		acc = ROTL(acc, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		acc ^= *p * P5;
+		acc = ROTL(acc, 11) * P1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= P2;
+	acc ^= acc >> 29;
+	acc *= P3;
+	acc ^= acc >> 32;
+	return acc;
+}
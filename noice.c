@@ -1,44 +1,97 @@
 /* See LICENSE file for copyright and license details. */
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range(2) and renameat2(2) */
+#endif
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <curses.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <libgen.h>
 #include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pwd.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#endif
 
 #include "util.h"
 
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 28)
+#define HAVE_COPY_FILE_RANGE
+#define HAVE_RENAMEAT2
+#endif
+
 #ifdef DEBUG
 #define DEBUG_FD 8
 #define DPRINTF_D(x) dprintf(DEBUG_FD, #x "=%d\n", x)
 #define DPRINTF_U(x) dprintf(DEBUG_FD, #x "=%u\n", x)
 #define DPRINTF_S(x) dprintf(DEBUG_FD, #x "=%s\n", x)
 #define DPRINTF_P(x) dprintf(DEBUG_FD, #x "=0x%p\n", x)
+#define MEMTAG(t) (memtag = (t))
 #else
 #define DPRINTF_D(x)
 #define DPRINTF_U(x)
 #define DPRINTF_S(x)
 #define DPRINTF_P(x)
+#define MEMTAG(t)
 #endif /* DEBUG */
 
 #define LEN(x) (sizeof(x) / sizeof(*(x)))
 #undef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#undef MAX
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define ISODD(x) ((x) & 1)
+/* Jobs started to fill in the listing rather than asked for */
+#define JOBINTERNAL(op) ((op) == JOB_LINKS || (op) == JOB_STAT)
+/* Mtime of an entry as one key, nanoseconds since the epoch */
+#define MTIMEKEY(e) ((long long)(e)->t * 1000000000 + (e)->tns)
 #define CONTROL(c) ((c) ^ 0x40)
 #define SHIFT(c) ((c) ^ 0x10)
+#define ISSEL(i) (selbits[(i) / 8] & (1 << ((i) % 8)))
+#define TABSEL(t, i) ((t)->selbits[(i) / 8] & (1 << ((i) % 8)))
+#define SELSET(i) (selbits[(i) / 8] |= 1 << ((i) % 8))
+#define SELCLR(i) (selbits[(i) / 8] &= ~(1 << ((i) % 8)))
+#define COPYBUF (1 << 20)   /* Buffer for plain copies */
+#define COPYCHUNK (8 << 20) /* Bytes per copy_file_range(2) call */
+#define HASHBUF (1 << 20)   /* Read size when hashing */
+#define DUPPREFIX (64 << 10) /* Bytes compared before full checksums */
+#define LINKBATCH 256       /* Links resolved between progress records */
+#define SCANBATCH 65536     /* Entries read before they are stat(2)ed at once */
+#define NOSIZE ((unsigned long)-1) /* Size of an entry that was not stat(2)ed */
+#define LATE ((time_t)-1)   /* Mtime of one whose stat(2) ran out of time */
+#define ARCCACHE 4          /* Archive indexes kept */
+#define MAXORPHANS 16       /* Mounts with stat(2) workers left behind */
+#define LISTTTL 2           /* Seconds another tab may share a listing */
+#define PAXMAX (4 << 20)    /* Largest pax header read, bigger ones are skipped */
+#define MAXCTL 8            /* Control clients at once */
+#define MAXTABS 9
+#define PACKBLK 16          /* Front-coded names per restart point */
+#define SPILLWIN 1024       /* Entries of a spilled listing paged in at once */
+#define CTLBUF (256 << 10)  /* Queued for a control client before dropping it */
+#define CTLKEY (KEY_MAX + 1) /* A control command set the action */
 
 struct assoc {
 	char *regex; /* Regex to match on filename */
@@ -65,6 +118,55 @@ enum action {
 	SEL_RUN,
 	SEL_RUNARG,
 	SEL_TOGGLEDOT,
+	SEL_STATS,
+	SEL_COPY,
+	SEL_MOVE,
+	SEL_DELETE,
+	SEL_JOBKILL,
+	SEL_MARK,
+	SEL_MARKRANGE,
+	SEL_MARKALL,
+	SEL_MARKCLR,
+	SEL_HASH,
+	SEL_HASHCOL,
+	SEL_OWNERCOL,
+	SEL_DUPS,
+	SEL_LARGEST,
+	SEL_RECENT,
+	SEL_TABNEW,
+	SEL_TABCLOSE,
+	SEL_TABNEXT,
+	SEL_TABPREV,
+	SEL_SPLIT,
+	SEL_COMPARE,
+	SEL_SNAP,
+	SEL_DIFF,
+	SEL_DIFFTREE,
+};
+
+/* Remote control button, sent as the key `sym' */
+struct button {
+	char *name;
+	int sym;
+};
+
+/* How to list a directory, chosen by the filesystem it lives on */
+enum scan {
+	SCAN_SERIAL,   /* stat(2) each entry as it is read */
+	SCAN_PARALLEL, /* stat(2) by nworkers processes at once */
+	SCAN_NOSTAT,   /* Only the type readdir(3) gives, no sizes or times */
+	SCAN_NOICED,   /* Served by noiced(1), not configurable */
+	SCAN_SHARED,   /* Another tab's listing, not read again */
+};
+
+struct fspolicy {
+	long type;     /* f_type of statfs(2), 0 for any other */
+	enum scan scan;
+};
+
+struct mountpolicy {
+	char *path;  /* Mount point or a directory under it */
+	int cached;  /* Take cached attributes without asking the server */
 };
 
 struct key {
@@ -75,28 +177,382 @@ struct key {
 	char *args;	 /* Extra program arguments */
 };
 
+/* Subsystems allocations are accounted to in debug builds */
+enum memtag {
+	MEM_LIST,
+	MEM_RENDER,
+	MEM_FLTR,
+	MEM_SPAWN,
+	MEM_NTAGS,
+};
+
 #include "config.h"
 
 struct entry {
-	char *name;
+	union {
+		char *name;
+		size_t id;        /* Into the pack of a packed listing */
+	};
 	mode_t mode;
+	char mark;                /* Shown before the name, or 0 */
 	time_t t;
+	long tns;                 /* Nanoseconds of t */
 	unsigned long size;
+	dev_t dev;
+	ino_t ino;
+	uid_t uid;                /* -1 when not known, like in archives */
+	gid_t gid;
+};
+
+/*
+ * Names of a long listing, front-coded in name order.  A record is the
+ * length of the prefix shared with the name before, the length of the
+ * rest and the rest.  Every PACKBLK-th name is whole so any name is a
+ * few records from a restart point.
+ */
+struct pack {
+	unsigned char *buf;
+	size_t len;
+	size_t *restart;          /* Offsets of the whole names */
+	size_t n;
+	size_t last, next;        /* Name last decoded and the record after */
+	char name[NAME_MAX + 1];
+};
+
+/*
+ * A listing over memcap, sorted on disk.  The scan writes sorted runs to
+ * one temporary file and merges them into another, which is mapped and
+ * paged in SPILLWIN entries at a time.  Records are a dentrec, the name
+ * and a NUL, so entries paged in name the mapping directly.
+ */
+struct spill {
+	FILE *fp;                 /* Runs, while scanning */
+	size_t len;
+	size_t *runs;             /* Offsets where the runs start */
+	int nruns;
+	int err;                  /* A run could not be written */
+	char *map;                /* Merged records */
+	size_t size;
+	size_t *index;            /* Offsets of every SPILLWIN-th record */
+	int n;
+	struct entry win[SPILLWIN]; /* Entries [wbase, wbase + wn) */
+	int wbase, wn;
+};
+
+struct cksum {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t t;
+	unsigned long long sum;
+	int used;
+};
+
+/* Target of a symlink, read in the background */
+struct link {
+	dev_t dev;
+	ino_t ino;
+	time_t t;                 /* Of the link when it was read */
+	char *target;
+	int broken;               /* The target does not resolve */
+	int used;
+};
+
+/* Name of a user or group, asked of the resolver */
+struct idname {
+	unsigned long long key;   /* The id shifted left, low bit for groups */
+	char *name;               /* NULL while asked, empty if unknown */
+	int used;
+};
+
+/* Record of a links job, the target follows */
+struct linkrec {
+	dev_t dev;
+	ino_t ino;
+	time_t t;
+	int broken;
+	int len;
+};
+
+struct hashfile {
+	char *path; /* Relative to the directory of the job */
+	mode_t mode;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t t;
+	unsigned long long sum;
+	int ok;     /* Set if sum is valid */
+};
+
+/* Result of a hash worker for the job */
+struct hashres {
+	int j;
+	int ok;
+	unsigned long long sum;
+};
+
+enum jobop {
+	JOB_COPY,
+	JOB_MOVE,
+	JOB_DELETE,
+	JOB_HASH,
+	JOB_DUPS,
+	JOB_LARGEST,
+	JOB_RECENT,
+	JOB_SNAP,
+	JOB_DIFF,
+	JOB_DIFFTREE,
+	JOB_LINKS,
+	JOB_STAT,
+};
+
+/* Listings other than the plain directory, filled from a view file */
+enum view {
+	VIEW_DIR,
+	VIEW_DUPS,
+	VIEW_LARGEST,
+	VIEW_RECENT,
+	VIEW_ARC,
+	VIEW_DIFF,
+};
+
+enum arctype {
+	ARC_TAR,
+	ARC_ZIP,
+};
+
+struct member {
+	char *path;               /* Relative to the archive root */
+	char *name;               /* Last component of path */
+	mode_t mode;
+	time_t t;
+	unsigned long long size;
+	off_t off;                /* Data for tar, local header for zip */
+	unsigned long long csize; /* Stored size */
+	int method;               /* Zip compression method */
+};
+
+struct archive {
+	dev_t dev;
+	ino_t ino;
+	time_t t;
+	enum arctype type;
+	struct member *m;         /* Sorted by path */
+	int n;
+	int refs;                 /* Tabs browsing it and the cache */
+};
+
+/* Entries of a directory in a walk, sorted by name */
+struct frame {
+	char *rel;                /* Path of the directory, NULL at the top */
+	struct entry *ents;
+	int n, i;
+};
+
+/* Walk of a tree in name order, live or from a snapshot */
+struct walk {
+	int dirfd;
+	FILE *fp;                 /* Snapshot records, NULL to read dirfd */
+	struct frame *st;         /* Directories being walked */
+	int nst;
+	struct entry ent;         /* Current entry, named by its path */
+};
+
+/*
+ * A directory listing, shared by the tabs showing the same directory
+ * with the same filter and order as long as it does not change
+ */
+struct listing {
+	struct entry *dents;
+	struct pack *pack;
+	struct spill *spill;
+	int n;
+	unsigned long totalsize;
+	unsigned long namebytes;
+	unsigned long gen;
+	int refs;                 /* Tabs pointing to it */
+	char *path;               /* NULL if not to be shared */
+	char *fltr;
+	int mtimeorder;
+	int owner;                /* Read with owners and groups */
+	int visit;                /* Marked against the last visit */
+	dev_t dev;                /* Of the directory when it was read */
+	ino_t ino;
+	struct timespec mtim;
+	struct timespec scanned;  /* When, on the monotonic clock */
+};
+
+/* Listing state of a tab while another one is shown */
+struct tab {
+	char *path;
+	size_t pathcap;
+	char *fltr;
+	struct listing *list;
+	struct entry *dents;
+	struct pack *pack;
+	struct spill *spill;
+	int n, cur;
+	int view;
+	char *viewfile;
+	struct archive *arc;
+	char *arcpath;
+	unsigned long totalsize;
+	unsigned char *selbits;
+	int nsel;
+	char **selkeep;
+	int nselkeep;
+	char *selpath;
+	int selview;
+	int selanchor;
+	int mtimeorder;
+	int stale;                /* A job finished since it was shown */
+	unsigned long id;         /* Jobs find the tab that started them */
+	unsigned long gen;
+	char *visitpath;
+	char *visitfltr;
+};
+
+/* Snapshot of an entry of a directory as it was last visited */
+struct visitrec {
+	unsigned long long key;   /* Name hash */
+	unsigned long long stamp; /* Size and mtime */
+};
+
+/* One side of the split layout and what was last drawn there */
+struct pane {
+	unsigned long gen;        /* Listing drawn, 0 to draw again */
+	int cur, top, nsel, rows, x, w, active, hash, own, cmp;
+	size_t nsums, nlinks;
+	unsigned long idgen;
+	int *order;               /* Entries in name order */
+	unsigned long ordergen;
+	char *marks;              /* Compare marks by entry */
+};
+
+struct ctl {
+	int fd;
+	char in[LINE_MAX];        /* Partial command */
+	size_t inlen;
+	char *out;                /* Replies and events not sent yet */
+	size_t outlen;
+};
+
+struct job {
+	pid_t pid;
+	int fd;                   /* Read end of the progress pipe */
+	enum jobop op;
+	char *dir;                /* Directory the names are in */
+	char **names;
+	int nnames;
+	char *dest;               /* Target or results file */
+	char *desc;               /* Shown in the job list */
+	unsigned long long done;  /* Bytes processed */
+	unsigned long long total; /* Bytes to process */
+	struct timespec start;
+	char ln[2 * PIPE_BUF];    /* Partial progress record */
+	size_t len;
+	int skip;                 /* Dropping the rest of an overlong one */
+	char err[PIPE_BUF];       /* Last error reported */
+	int fresh;                /* New results to show */
+	int shown;                /* Results were put in a view */
+	off_t off;                /* Of the results read so far */
+	unsigned long tab;        /* Id of the tab it was started in */
 };
 
 /* Global context */
+struct listing *list;   /* Of the current tab, dents and below mirror it */
 struct entry *dents;
+struct pack *pack;      /* Names of dents when front-coded, or NULL */
+struct spill *spill;    /* The listing when it is on disk, dents is NULL */
 int n, cur;
 char *path, *oldpath;
+size_t pathcap;         /* Bytes allocated for path */
 char *fltr;
+int view;
+char *viewfile;
 int idle;
 unsigned long totalsize;
+unsigned char *selbits; /* A bit per entry, set if selected */
+int nsel;
+char **selkeep;         /* Selected names kept across a rescan */
+int nselkeep;
+char *selpath;          /* Directory the selection belongs to */
+int selview;
+int selanchor = -1;     /* Where a range selection starts */
+struct cksum *cksums;   /* Open addressing on (dev, ino) */
+size_t ncksums, cksumcap;
+struct link *links;     /* Open addressing on (dev, ino) */
+size_t nlinks, linkcap;
+struct idname *idnames; /* Open addressing on the key */
+size_t nidnames, idcap;
+unsigned long idgen;    /* Bumped when a name comes in */
+int idfd = -1;          /* Socket to the resolver */
+pid_t idpid;            /* Resolver, -1 if it could not start */
+off_t cksumoff;         /* Records of cksumfile read so far */
+struct job *jobs;
+int njobs;
+char jobmsg[LINE_MAX]; /* Outcome of the last finished job */
+int remotefd = -1;     /* Remote control buttons come in here */
+char remotebuf[LINE_MAX];
+size_t remotelen;
+struct timespec remotetv; /* When the last button was read */
+int ctlfd = -1;        /* Control socket */
+struct ctl ctls[MAXCTL];
+int ctlkey = ERR;      /* Key or CTLKEY from the last control command */
+int ctlact;            /* Action for CTLKEY */
+char *ctlpath;         /* State last sent to control clients */
+int ctlcur = -1, ctlsel = -1;
+struct tab tabs[MAXTABS]; /* The current tab lives in the globals above */
+int ntabs = 1, curtab;
+unsigned long tabids;   /* Last tab id given out */
+unsigned long gen;      /* Of the listing, bumped when it changes */
+unsigned long listgen;
+struct pane panes[2];   /* Left and right */
+char *visitpath;        /* Directory the listing was read from */
+int rescan;             /* Read the directory even if a tab has it */
+char *visitfltr;        /* Filter it was read with */
+int split;              /* Show two tabs side by side */
+int othertab = -1;      /* Tab in the other pane */
+int cmpmode;            /* Mark what differs between the panes */
+unsigned long cmpgen[2]; /* Listings the marks were found for */
+struct entry *orderdents; /* Listing ordercmp() sorts an index of */
+struct archive *arcs[ARCCACHE]; /* Most recently used first */
+struct archive *arc;    /* Archive being browsed */
+char *arcpath;          /* Its path, path is below it */
+
+#ifdef DEBUG
+/* Header in front of every allocation to account for it on release */
+union memhdr {
+	struct {
+		size_t size;
+		int tag;
+	} m;
+	long double align;
+};
+
+struct memstat {
+	unsigned long live;   /* Bytes currently allocated */
+	unsigned long nalloc; /* Number of allocations so far */
+} memstats[MEM_NTAGS];
+int memtag;
+#endif /* DEBUG */
+
+/* Metrics sampled once per scan and frame, shown with SEL_STATS */
+unsigned long namebytes;
+long scanus, sortus, drawus;
+long scanfs;            /* Filesystem type of the listing */
+enum scan scanhow;      /* How it was read */
+int nlate;              /* Entries whose stat(2) it stopped waiting for */
+char *scannames[] = { "serial", "parallel", "nostat", "noiced", "shared" };
+long inputus;           /* From a button read to its frame drawn */
+unsigned long cachehits, cachemiss;
 
 /*
  * Layout:
  * .---------
  * | cwd: /mnt/path
- * |
+ * | [metrics]
  * |    file0
  * |    file1
  * |  > file2
@@ -113,8 +569,28 @@ void printmsg(char *);
 void printwarn(void);
 void printerr(int, char *);
 char *mkpath(char *, char *);
+int pathopen(const char *, int);
 char *printsize(unsigned long size);
 char filemode(mode_t mod);
+void dentdel(char *, char *);
+int dentwrite(int, struct entry *);
+char *entname(struct pack *, struct entry *, char *);
+void dentspill(struct entry *, int);
+struct entry *dentat(struct spill *, struct entry *, int);
+void viewopen(int, char *, char *);
+void viewclose(void);
+void arcput(struct archive *);
+int cksumget(dev_t, ino_t, off_t, time_t, unsigned long long *);
+struct link *linkget(struct entry *);
+char *idname(int, unsigned long, char *, size_t);
+void visitsave(char *, struct entry *, int, struct pack *, char *);
+void selsave(void);
+void selload(void);
+void statstart(void);
+void linkstart(void);
+int viewput(struct job *, int, char *);
+int jobcount(int);
+void listown(void);
 
 #undef dprintf
 int
@@ -132,12 +608,83 @@ dprintf(int fd, const char *fmt, ...)
 	return r;
 }
 
+#ifdef DEBUG
+void *
+memget(void *p, size_t size)
+{
+	union memhdr *h = p;
+
+	if (h != NULL) {
+		h--;
+		memstats[h->m.tag].live -= h->m.size;
+	}
+	h = realloc(h, sizeof(*h) + size);
+	if (h == NULL)
+		return NULL;
+	h->m.size = size;
+	h->m.tag = memtag;
+	memstats[memtag].live += size;
+	memstats[memtag].nalloc++;
+	return h + 1;
+}
+
+void
+xfree(void *p)
+{
+	union memhdr *h = p;
+
+	if (h == NULL)
+		return;
+	h--;
+	memstats[h->m.tag].live -= h->m.size;
+	free(h);
+}
+
+/* Log live bytes and allocation rate per subsystem */
+void
+memreport(void)
+{
+	static char *tags[] = { "listing", "render", "filter", "spawn" };
+	static unsigned long lastn[MEM_NTAGS];
+	static struct timespec last;
+	struct timespec now;
+	double secs;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - last.tv_sec) +
+	    (now.tv_nsec - last.tv_nsec) / 1000000000.0;
+	for (i = 0; i < MEM_NTAGS; i++) {
+		dprintf(DEBUG_FD, "mem %s: live=%lu allocs=%lu rate=%.0f/s\n",
+		    tags[i], memstats[i].live, memstats[i].nalloc,
+		    (memstats[i].nalloc - lastn[i]) / secs);
+		lastn[i] = memstats[i].nalloc;
+	}
+	last = now;
+}
+
+/* Return the number of bytes still allocated */
+unsigned long
+memlive(void)
+{
+	unsigned long live = 0;
+	int i;
+
+	for (i = 0; i < MEM_NTAGS; i++)
+		live += memstats[i].live;
+	return live;
+}
+#else
+#define memget(p, size) realloc(p, size)
+#define xfree(p) free(p)
+#endif /* DEBUG */
+
 void *
 xmalloc(size_t size)
 {
 	void *p;
 
-	p = malloc(size);
+	p = memget(NULL, size);
 	if (p == NULL)
 		printerr(1, "malloc");
 	return p;
@@ -146,7 +693,7 @@ xmalloc(size_t size)
 void *
 xrealloc(void *p, size_t size)
 {
-	p = realloc(p, size);
+	p = memget(p, size);
 	if (p == NULL)
 		printerr(1, "realloc");
 	return p;
@@ -155,12 +702,14 @@ xrealloc(void *p, size_t size)
 char *
 xstrdup(const char *s)
 {
+	size_t len;
 	char *p;
 
-	p = strdup(s);
+	len = strlen(s) + 1;
+	p = memget(NULL, len);
 	if (p == NULL)
 		printerr(1, "strdup");
-	return p;
+	return memcpy(p, s, len);
 }
 
 char *
@@ -174,29 +723,27 @@ xdirname(const char *path)
 	tmp = xstrdup(path);
 	p = dirname(tmp);
 	if (p == NULL) {
-		free(tmp);
+		xfree(tmp);
 		printerr(1, "dirname");
 	}
 	/* Make sure this is a malloc(3)-ed string */
 	p = xstrdup(p);
-	free(tmp);
+	xfree(tmp);
 	return p;
 }
 
 void
-spawn(const char *file, const char *arg, const char *dir, const char *args)
+spawnv(const char *file, char *const argv[], const char *dir)
 {
 	pid_t pid;
-	int status;
+	int fd, status;
 
 	pid = fork();
 	if (pid == 0) {
-		if (dir != NULL)
-			chdir(dir);
-		if (args != NULL)
-			execlp(file, file, args, arg, NULL);
-		else
-			execlp(file, file, arg, NULL);
+		if (dir != NULL && (fd = pathopen(dir,
+		    O_RDONLY | O_DIRECTORY)) != -1)
+			fchdir(fd);
+		execvp(file, argv);
 		_exit(1);
 	} else {
 		/* Ignore interruptions */
@@ -206,6 +753,63 @@ spawn(const char *file, const char *arg, const char *dir, const char *args)
 	}
 }
 
+void
+spawn(const char *file, const char *arg, const char *dir, const char *args)
+{
+	char *argv[4];
+	int i = 0;
+
+	argv[i++] = (char *)file;
+	if (args != NULL)
+		argv[i++] = (char *)args;
+	argv[i++] = (char *)arg;
+	argv[i] = NULL;
+	spawnv(file, argv, dir);
+}
+
+/* Run `file' on `names' like xargs(1), as many at a time as ARG_MAX allows */
+void
+spawnargs(const char *file, char **names, int nnames, const char *dir,
+	  const char *args)
+{
+	extern char **environ;
+	char **argv;
+	long max, len, fixed;
+	int i, j, k;
+
+	MEMTAG(MEM_SPAWN);
+	max = sysconf(_SC_ARG_MAX);
+	if (max == -1)
+		max = _POSIX_ARG_MAX;
+	/* The environment shares the space, leave headroom like xargs(1) */
+	for (i = 0; environ[i] != NULL; i++)
+		max -= strlen(environ[i]) + 1 + sizeof(char *);
+	max -= 2048;
+	fixed = strlen(file) + 1 + sizeof(char *);
+	if (args != NULL)
+		fixed += strlen(args) + 1 + sizeof(char *);
+
+	argv = xmalloc((nnames + 3) * sizeof(*argv));
+	for (i = 0; i < nnames; i = j) {
+		k = 0;
+		argv[k++] = (char *)file;
+		if (args != NULL)
+			argv[k++] = (char *)args;
+		len = fixed;
+		for (j = i; j < nnames; j++) {
+			len += strlen(names[j]) + 1 + sizeof(char *);
+			/* At least one name per run */
+			if (len > max && j > i)
+				break;
+			argv[k++] = names[j];
+		}
+		argv[k] = NULL;
+		spawnv(file, argv, dir);
+	}
+	xfree(argv);
+	MEMTAG(MEM_LIST);
+}
+
 char *
 xgetenv(char *name, char *fallback)
 {
@@ -222,13 +826,15 @@ openwith(char *file)
 {
 	regex_t regex;
 	char *bin = NULL;
-	int i;
+	int i, r;
 
 	for (i = 0; i < LEN(assocs); i++) {
 		if (regcomp(&regex, assocs[i].regex,
 			    REG_NOSUB | REG_EXTENDED | REG_ICASE) != 0)
 			continue;
-		if (regexec(&regex, file, 0, NULL, 0) == 0) {
+		r = regexec(&regex, file, 0, NULL, 0);
+		regfree(&regex);
+		if (r == 0) {
 			bin = assocs[i].bin;
 			break;
 		}
@@ -244,13 +850,15 @@ setfilter(regex_t *regex, char *filter)
 	char *errbuf;
 	int r;
 
+	MEMTAG(MEM_FLTR);
 	r = regcomp(regex, filter, REG_NOSUB | REG_EXTENDED | REG_ICASE);
 	if (r != 0) {
 		errbuf = xmalloc(COLS * sizeof(char));
 		regerror(r, regex, errbuf, COLS * sizeof(char));
 		printmsg(errbuf);
-		free(errbuf);
+		xfree(errbuf);
 	}
+	MEMTAG(MEM_LIST);
 
 	return r;
 }
@@ -269,11 +877,48 @@ entrycmp(const void *va, const void *vb)
 	a = (struct entry *)va;
 	b = (struct entry *)vb;
 
-	if (mtimeorder)
-		return b->t - a->t;
+	/* Newest first, the same second goes by nanoseconds, then name */
+	if (mtimeorder && MTIMEKEY(a) != MTIMEKEY(b))
+		return MTIMEKEY(a) < MTIMEKEY(b) ? 1 : -1;
 	return strcmp(a->name, b->name);
 }
 
+/* Whether entries of the same name differ in type, size or mtime */
+int
+dentdiffer(struct entry *a, struct entry *b)
+{
+	if ((a->mode & S_IFMT) != (b->mode & S_IFMT))
+		return 1;
+	/* The size and mtime of a directory say little about its contents */
+	if (S_ISDIR(a->mode))
+		return 0;
+	return a->size != b->size || a->t != b->t;
+}
+
+/* Return the microseconds elapsed since `ts' on the monotonic clock */
+long
+usecsince(struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - ts->tv_sec) * 1000000L +
+	    (now.tv_nsec - ts->tv_nsec) / 1000;
+}
+
+/* FNV-1a hash of a string */
+unsigned long
+namehash(const char *s)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
 void
 initcurses(void)
 {
@@ -330,7 +975,7 @@ char *printsize(unsigned long size)
 		lcount++;
 	}
 
-	strsize = malloc(15);
+	strsize = xmalloc(15);
 	sprintf(strsize, "%12.3f%c", printsize, units[lcount]);
 	return(strsize);
 }
@@ -350,311 +995,6342 @@ printprompt(char *str)
 	printw(str);
 }
 
-/* Returns SEL_* if key is bound and 0 otherwise
-   Also modifies the run and env pointers (used on SEL_{RUN,RUNARG}) */
+/* Ask a yes or no question on the last line */
 int
-nextsel(char **run, char **env, char **args)
+confirm(char *str)
 {
-	int c, i;
+	int c;
 
+	clearprompt();
+	printw("%s [y/N] ", str);
+	timeout(-1);
 	c = getch();
-	if (c == -1)
-		idle++;
-	else
-		idle = 0;
+	timeout(1000);
+	clearprompt();
+	return c == 'y' || c == 'Y';
+}
 
-	for (i = 0; i < LEN(bindings); i++)
-		if (c == bindings[i].sym) {
-			*run = bindings[i].run;
-			*env = bindings[i].env;
-			*args = bindings[i].args;
-			return bindings[i].act;
-		}
+/* Open the FIFO or connect to the lircd(8) socket in remotefile */
+void
+remoteopen(void)
+{
+	struct sockaddr_un sun;
+	struct stat sb;
 
-	return 0;
+	remotelen = 0;
+	if (remotefile == NULL || stat(remotefile, &sb) == -1)
+		return;
+	if (S_ISFIFO(sb.st_mode)) {
+		remotefd = open(remotefile, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		return;
+	}
+	if (!S_ISSOCK(sb.st_mode) ||
+	    strlen(remotefile) >= sizeof(sun.sun_path))
+		return;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, remotefile, sizeof(sun.sun_path));
+	remotefd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (remotefd == -1)
+		return;
+	if (connect(remotefd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(remotefd);
+		remotefd = -1;
+		return;
+	}
+	fcntl(remotefd, F_SETFL, O_NONBLOCK);
 }
 
-char *
-readln(void)
+/* Buffer what the remote sent, reopen it when the writer went away */
+void
+remoteread(void)
 {
-	char ln[LINE_MAX];
+	ssize_t r;
 
-	timeout(-1);
-	echo();
-	curs_set(TRUE);
-	memset(ln, 0, sizeof(ln));
-	wgetnstr(stdscr, ln, sizeof(ln) - 1);
-	noecho();
-	curs_set(FALSE);
-	timeout(1000);
-	return ln[0] ? strdup(ln) : NULL;
+	r = read(remotefd, remotebuf + remotelen,
+	    sizeof(remotebuf) - remotelen);
+	if (r > 0) {
+		remotelen += r;
+		/* Not a button line */
+		if (remotelen == sizeof(remotebuf) &&
+		    memchr(remotebuf, '\n', remotelen) == NULL)
+			remotelen = 0;
+		return;
+	}
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	close(remotefd);
+	remotefd = -1;
+	remoteopen();
 }
 
 /*
- * Read one key and modify the provided string accordingly.
- * Returns 0 when more input is expected and 1 on completion.
+ * Return the key of the next button buffered, ERR if there is none.
+ * Lines are a button name, or code, repeat, button and remote name as
+ * irw(1) prints them.
  */
 int
-readmore(char **str)
+remotekey(void)
 {
-	int c, ret = 0;
-	int i;
-	char *ln = *str;
-
-	timeout(-1);
-	if (ln != NULL)
-		i = strlen(ln);
-	else
-		i = 0;
-	DPRINTF_D(i);
-
-	curs_set(TRUE);
+	char *nl, *p, *f[4];
+	int c = ERR, i, nf;
 
-	c = getch();
-	switch (c) {
-	case KEY_ENTER:
-	case '\r':
-		ret = 1;
-		break;
-	case KEY_BACKSPACE:
-	case CONTROL('H'):
-		i--;
-		if (i > 0) {
-			ln = xrealloc(ln, (i + 1) * sizeof(*ln));
-			ln[i] = '\0';
-		} else {
-			free(ln);
-			ln = NULL;
-		}
-		break;
-	default:
-		i++;
-		ln = xrealloc(ln, (i + 1) * sizeof(*ln));
-		ln[i - 1] = c;
-		ln[i] = '\0';
+	while (c == ERR &&
+	    (nl = memchr(remotebuf, '\n', remotelen)) != NULL) {
+		*nl = '\0';
+		nf = 0;
+		for (p = strtok(remotebuf, " \t\r"); p != NULL && nf < 4;
+		     p = strtok(NULL, " \t\r"))
+			f[nf++] = p;
+		p = nf >= 3 ? f[2] : nf == 1 ? f[0] : NULL;
+		for (i = 0; p != NULL && i < (int)LEN(buttons); i++)
+			if (strcmp(p, buttons[i].name) == 0) {
+				c = buttons[i].sym;
+				break;
+			}
+		remotelen -= nl + 1 - remotebuf;
+		memmove(remotebuf, nl + 1, remotelen);
 	}
+	if (c != ERR)
+		clock_gettime(CLOCK_MONOTONIC, &remotetv);
+	return c;
+}
 
-	curs_set(FALSE);
-
-	*str = ln;
-	timeout(1000);
+/*
+ * Control API for front-ends, on the Unix-domain socket ctlsock.  One
+ * command per line, each answered with one line unless noted:
+ *   path          path P
+ *   list OFF CNT  list N CUR K, then K lines I TYPE SIZE MTIME SEL NAME
+ *   cur I         move the cursor
+ *   filter RE     set the filter
+ *   sort name|time
+ *   key K         press key K, a character or a button name
+ * Changes of path, cursor and selection are sent as path P, cur I and
+ * sel N lines after each frame.  Names escape newline and backslash.
+ * Replies are queued and a client that does not read is dropped, so
+ * the browser never waits on one.
+ */
 
-	return ret;
+/* Drop a control client */
+void
+ctldrop(struct ctl *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	xfree(c->out);
+	c->out = NULL;
+	c->outlen = 0;
+	c->inlen = 0;
 }
 
-int
-canopendir(char *path)
+/* Send what is queued for a client, as much as it takes now */
+void
+ctlflush(struct ctl *c)
 {
-	DIR *dirp;
+	ssize_t r;
 
-	dirp = opendir(path);
-	if (dirp == NULL)
-		return 0;
-	closedir(dirp);
-	return 1;
+	if (c->outlen == 0)
+		return;
+	r = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (r == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			ctldrop(c);
+		return;
+	}
+	c->outlen -= r;
+	memmove(c->out, c->out + r, c->outlen);
 }
 
-char filemode(mode_t mod)
+void
+ctlwrite(struct ctl *c, const char *buf, size_t len)
 {
-	char cm=0;
-
-	if (S_ISDIR(mod)) {
-		cm = '/';
-	} else if (S_ISLNK(mod)) {
-		cm = '@';
-	} else if (S_ISSOCK(mod)) {
-		cm = '=';
-	} else if (S_ISFIFO(mod)) {
-		cm = '|';
-	} else if (mod & S_IXUSR) {
-		cm = '*';
+	if (c->fd == -1)
+		return;
+	if (c->outlen + len > CTLBUF) {
+		ctldrop(c);
+		return;
 	}
-
-	return cm;
+	c->out = xrealloc(c->out, c->outlen + len);
+	memcpy(c->out + c->outlen, buf, len);
+	c->outlen += len;
 }
 
 void
-printent(struct entry *ent, int active)
+ctlprintf(struct ctl *c, const char *fmt, ...)
 {
-	char *name, *size;
-	unsigned int maxlen = COLS - strlen(CURSR) - 17;
-	char cm = 0;
-	int row, col;
-
-	getyx(stdscr, row, col);
+	char buf[LINE_MAX];
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (r > 0)
+		ctlwrite(c, buf, MIN((size_t)r, sizeof(buf) - 1));
+}
+
+/* Queue `s' with newlines and backslashes escaped, then a newline */
+void
+ctlname(struct ctl *c, const char *s)
+{
+	size_t len;
+
+	while (*s != '\0') {
+		len = strcspn(s, "\n\\");
+		ctlwrite(c, s, len);
+		s += len;
+		if (*s == '\n')
+			ctlwrite(c, "\\n", 2);
+		else if (*s == '\\')
+			ctlwrite(c, "\\\\", 2);
+		if (*s != '\0')
+			s++;
+	}
+	ctlwrite(c, "\n", 1);
+}
+
+/* Send the entries in [off, off + cnt) straight from the listing */
+void
+ctllist(struct ctl *c, int off, int cnt)
+{
+	struct entry *ent;
+	char type, buf[NAME_MAX + 1];
+	int i;
+
+	off = MAX(0, MIN(off, n));
+	cnt = MAX(0, MIN(cnt, n - off));
+	ctlprintf(c, "list %d %d %d\n", n, cur, cnt);
+	for (i = off; i < off + cnt; i++) {
+		ent = dentat(spill, dents, i);
+		type = S_ISDIR(ent->mode) ? '/' : filemode(ent->mode);
+		ctlprintf(c, "%d %c %lu %lld %d ", i, type ? type : '-',
+		    ent->size, (long long)ent->t, ISSEL(i) ? 1 : 0);
+		ctlname(c, entname(pack, ent, buf));
+	}
+}
+
+/* Run a command, the key it stands for goes to ctlkey */
+void
+ctlcmd(struct ctl *c, char *ln)
+{
+	char buf[LINE_MAX], *arg;
+	regex_t re;
+	int i, off, cnt, r;
+
+	arg = strchr(ln, ' ');
+	if (arg != NULL)
+		*arg++ = '\0';
+	else
+		arg = "";
+
+	if (strcmp(ln, "path") == 0) {
+		ctlwrite(c, "path ", 5);
+		ctlname(c, path);
+	} else if (strcmp(ln, "list") == 0) {
+		if (sscanf(arg, "%d %d", &off, &cnt) != 2) {
+			off = 0;
+			cnt = n;
+		}
+		ctllist(c, off, cnt);
+	} else if (strcmp(ln, "cur") == 0) {
+		if (n > 0)
+			cur = MAX(0, MIN(atoi(arg), n - 1));
+		ctlkey = CTLKEY;
+		ctlact = 0;
+		ctlprintf(c, "ok\n");
+	} else if (strcmp(ln, "filter") == 0) {
+		r = regcomp(&re, arg, REG_NOSUB | REG_EXTENDED | REG_ICASE);
+		if (r != 0) {
+			regerror(r, &re, buf, sizeof(buf));
+			ctlprintf(c, "err %s\n", buf);
+			return;
+		}
+		regfree(&re);
+		xfree(fltr);
+		fltr = xstrdup(arg);
+		ctlkey = CTLKEY;
+		ctlact = SEL_REDRAW;
+		ctlprintf(c, "ok\n");
+	} else if (strcmp(ln, "sort") == 0) {
+		mtimeorder = strcmp(arg, "time") == 0;
+		ctlkey = CTLKEY;
+		ctlact = SEL_REDRAW;
+		ctlprintf(c, "ok\n");
+	} else if (strcmp(ln, "key") == 0 && arg[0] != '\0') {
+		ctlkey = arg[1] == '\0' ? (unsigned char)arg[0] : ERR;
+		for (i = 0; i < (int)LEN(buttons); i++)
+			if (strcmp(arg, buttons[i].name) == 0)
+				ctlkey = buttons[i].sym;
+		ctlprintf(c, ctlkey != ERR ? "ok\n" : "err no such key\n");
+	} else {
+		ctlprintf(c, "err unknown command\n");
+	}
+}
+
+/* Run the complete lines a client sent until one stands for a key */
+void
+ctlrun(struct ctl *c)
+{
+	char *nl;
+	size_t len;
+
+	while (c->fd != -1 && ctlkey == ERR &&
+	    (nl = memchr(c->in, '\n', c->inlen)) != NULL) {
+		*nl = '\0';
+		if (nl > c->in && nl[-1] == '\r')
+			nl[-1] = '\0';
+		ctlcmd(c, c->in);
+		/* Dropped for not reading the replies */
+		if (c->fd == -1)
+			return;
+		len = nl + 1 - c->in;
+		c->inlen -= len;
+		memmove(c->in, c->in + len, c->inlen);
+	}
+	ctlflush(c);
+}
+
+void
+ctlread(struct ctl *c)
+{
+	ssize_t r;
+
+	r = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		ctldrop(c);
+		return;
+	}
+	c->inlen += r;
+	/* A line longer than any command */
+	if (c->inlen == sizeof(c->in) && memchr(c->in, '\n', c->inlen) == NULL)
+		ctldrop(c);
+}
+
+void
+ctlaccept(void)
+{
+	int fd, i;
+
+	while ((fd = accept(ctlfd, NULL, NULL)) != -1) {
+		for (i = 0; i < MAXCTL; i++)
+			if (ctls[i].fd == -1)
+				break;
+		if (i == MAXCTL) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		ctls[i].fd = fd;
+	}
+}
+
+/* Listen on ctlsock, for this user only */
+void
+ctlopen(void)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int i, r;
+
+	for (i = 0; i < MAXCTL; i++)
+		ctls[i].fd = -1;
+	if (ctlsock == NULL || strlen(ctlsock) >= sizeof(sun.sun_path))
+		return;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, ctlsock, sizeof(sun.sun_path));
+	ctlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (ctlfd == -1)
+		return;
+	unlink(ctlsock);
+	/* Created private, never reachable by others even for a moment */
+	mask = umask(077);
+	r = bind(ctlfd, (struct sockaddr *)&sun, sizeof(sun));
+	umask(mask);
+	if (r == -1 || listen(ctlfd, MAXCTL) == -1) {
+		close(ctlfd);
+		ctlfd = -1;
+	}
+}
+
+void
+ctlclose(void)
+{
+	int i;
+
+	for (i = 0; i < MAXCTL; i++)
+		if (ctls[i].fd != -1)
+			ctldrop(&ctls[i]);
+	if (ctlfd != -1) {
+		close(ctlfd);
+		unlink(ctlsock);
+		ctlfd = -1;
+	}
+	xfree(ctlpath);
+	ctlpath = NULL;
+}
+
+/* Tell control clients what changed since the last frame */
+void
+ctlnotify(void)
+{
+	struct ctl *c;
+	int i, newpath;
+
+	if (ctlfd == -1)
+		return;
+	newpath = ctlpath == NULL || strcmp(ctlpath, path) != 0;
+	for (i = 0; i < MAXCTL; i++) {
+		c = &ctls[i];
+		if (c->fd == -1)
+			continue;
+		if (newpath) {
+			ctlwrite(c, "path ", 5);
+			ctlname(c, path);
+		}
+		if (newpath || cur != ctlcur)
+			ctlprintf(c, "cur %d\n", cur);
+		if (nsel != ctlsel)
+			ctlprintf(c, "sel %d\n", nsel);
+		if (c->fd != -1)
+			ctlflush(c);
+	}
+	if (newpath) {
+		xfree(ctlpath);
+		ctlpath = xstrdup(path);
+	}
+	ctlcur = cur;
+	ctlsel = nsel;
+}
+
+/*
+ * Wait for a key from the terminal, a button from the remote or a
+ * command from a control client, for a second at most
+ */
+int
+nextkey(void)
+{
+	struct pollfd pfd[3 + MAXCTL];
+	struct timespec ts;
+	long left;
+	int c = ERR, i;
+
+	if (remotefd == -1 && ctlfd == -1) {
+		c = getch();
+		/* Try again while idle, lircd may be back */
+		if (c == ERR && remotefile != NULL)
+			remoteopen();
+		return c;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timeout(0);
+	while ((left = 1000 - usecsince(&ts) / 1000) > 0) {
+		/* What is buffered already comes first */
+		if ((c = getch()) != ERR || (c = remotekey()) != ERR)
+			break;
+		for (i = 0; i < MAXCTL && ctlkey == ERR; i++)
+			if (ctls[i].fd != -1)
+				ctlrun(&ctls[i]);
+		if ((c = ctlkey) != ERR) {
+			ctlkey = ERR;
+			break;
+		}
+
+		pfd[0].fd = STDIN_FILENO;
+		pfd[1].fd = remotefd;
+		pfd[2].fd = ctlfd;
+		for (i = 0; i < 3; i++)
+			pfd[i].events = POLLIN;
+		for (i = 0; i < MAXCTL; i++) {
+			pfd[3 + i].fd = ctls[i].fd;
+			pfd[3 + i].events = POLLIN;
+			if (ctls[i].outlen > 0)
+				pfd[3 + i].events |= POLLOUT;
+		}
+		if (poll(pfd, LEN(pfd), left) <= 0)
+			continue;
+		if (pfd[1].revents != 0)
+			remoteread();
+		if (pfd[2].revents != 0)
+			ctlaccept();
+		for (i = 0; i < MAXCTL; i++) {
+			if (ctls[i].fd == -1 || pfd[3 + i].revents == 0)
+				continue;
+			if (pfd[3 + i].revents & POLLOUT)
+				ctlflush(&ctls[i]);
+			if (ctls[i].fd != -1 &&
+			    pfd[3 + i].revents & (POLLIN | POLLHUP | POLLERR))
+				ctlread(&ctls[i]);
+		}
+		/* Only the remote may have been closed with nothing read */
+		if (remotefd == -1 && remotefile != NULL)
+			remoteopen();
+	}
+	timeout(1000);
+	return c;
+}
+
+/* Returns SEL_* if key is bound and 0 otherwise
+   Also modifies the run and env pointers (used on SEL_{RUN,RUNARG}) */
+int
+nextsel(char **run, char **env, char **args)
+{
+	int c, i;
+
+	c = nextkey();
+	if (c == -1)
+		idle++;
+	else
+		idle = 0;
+
+	if (c == CTLKEY)
+		return ctlact;
+
+	for (i = 0; i < LEN(bindings); i++)
+		if (c == bindings[i].sym) {
+			*run = bindings[i].run;
+			*env = bindings[i].env;
+			*args = bindings[i].args;
+			return bindings[i].act;
+		}
+
+	return 0;
+}
+
+char *
+readln(void)
+{
+	char ln[LINE_MAX];
+	char *s;
+
+	timeout(-1);
+	echo();
+	curs_set(TRUE);
+	memset(ln, 0, sizeof(ln));
+	wgetnstr(stdscr, ln, sizeof(ln) - 1);
+	noecho();
+	curs_set(FALSE);
+	timeout(1000);
+	MEMTAG(MEM_FLTR);
+	s = ln[0] ? xstrdup(ln) : NULL;
+	MEMTAG(MEM_LIST);
+	return s;
+}
+
+/*
+ * Read one key and modify the provided string accordingly.
+ * Returns 0 when more input is expected and 1 on completion.
+ */
+int
+readmore(char **str)
+{
+	int c, ret = 0;
+	int i;
+	char *ln = *str;
+
+	MEMTAG(MEM_FLTR);
+	timeout(-1);
+	if (ln != NULL)
+		i = strlen(ln);
+	else
+		i = 0;
+	DPRINTF_D(i);
+
+	curs_set(TRUE);
+
+	c = getch();
+	switch (c) {
+	case KEY_ENTER:
+	case '\r':
+		ret = 1;
+		break;
+	case KEY_BACKSPACE:
+	case CONTROL('H'):
+		i--;
+		if (i > 0) {
+			ln = xrealloc(ln, (i + 1) * sizeof(*ln));
+			ln[i] = '\0';
+		} else {
+			xfree(ln);
+			ln = NULL;
+		}
+		break;
+	default:
+		i++;
+		ln = xrealloc(ln, (i + 1) * sizeof(*ln));
+		ln[i - 1] = c;
+		ln[i] = '\0';
+	}
+
+	curs_set(FALSE);
+
+	*str = ln;
+	timeout(1000);
+	MEMTAG(MEM_LIST);
+
+	return ret;
+}
+
+int
+canopendir(char *path)
+{
+	DIR *dirp;
+	int fd;
+
+	fd = pathopen(path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return 0;
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		return 0;
+	}
+	closedir(dirp);
+	return 1;
+}
+
+char filemode(mode_t mod)
+{
+	char cm=0;
+
+	if (S_ISDIR(mod)) {
+		cm = '/';
+	} else if (S_ISLNK(mod)) {
+		cm = '@';
+	} else if (S_ISSOCK(mod)) {
+		cm = '=';
+	} else if (S_ISFIFO(mod)) {
+		cm = '|';
+	} else if (mod & S_IXUSR) {
+		cm = '*';
+	}
+
+	return cm;
+}
+
+/* Write the permissions of `mod' like ls(1) into `buf' of 11 bytes */
+void
+modestr(mode_t mod, char *buf)
+{
+	static const char rwx[] = "rwxrwxrwx";
+	int i;
+
+	if (S_ISDIR(mod))
+		buf[0] = 'd';
+	else if (S_ISLNK(mod))
+		buf[0] = 'l';
+	else if (S_ISCHR(mod))
+		buf[0] = 'c';
+	else if (S_ISBLK(mod))
+		buf[0] = 'b';
+	else if (S_ISFIFO(mod))
+		buf[0] = 'p';
+	else if (S_ISSOCK(mod))
+		buf[0] = 's';
+	else
+		buf[0] = '-';
+	for (i = 0; i < 9; i++)
+		buf[i + 1] = mod & (0400 >> i) ? rwx[i] : '-';
+	if (mod & S_ISUID)
+		buf[3] = mod & S_IXUSR ? 's' : 'S';
+	if (mod & S_ISGID)
+		buf[6] = mod & S_IXGRP ? 's' : 'S';
+	if (mod & S_ISVTX)
+		buf[9] = mod & S_IXOTH ? 't' : 'T';
+	buf[10] = '\0';
+}
+
+/* Print `ent', named in `pk' if packed, on the row in columns [x, x + w) */
+void
+printent(struct entry *ent, struct pack *pk, int active, int marked, int x,
+    int w, int mark)
+{
+	char *name, *size, buf[NAME_MAX + 1];
+	char perm[11], ubuf[32], gbuf[32], *user;
+	unsigned int maxlen = w - strlen(CURSR) - 17;
+	unsigned long long sum;
+	struct link *l = NULL;
+	char cm = 0;
+	int row, col, hash, own;
+
+	getyx(stdscr, row, col);
 
 	/* Copy name locally */
-	name = xstrdup(ent->name);
+	name = xstrdup(entname(pk, ent, buf));
 
+	/* No room for digests in a narrow pane */
+	hash = showhash && w >= 64;
 	if ((cm = filemode(ent->mode)) != 0)
 		maxlen--;
+	if (showlinks && S_ISLNK(ent->mode) && (l = linkget(ent)) != NULL &&
+	    l->broken)
+		cm = '!';
+	if (hash)
+		maxlen -= 17;
+	/* Owners only if the name keeps some room */
+	own = showowner && maxlen >= 29 + 16;
+	if (own)
+		maxlen -= 29;
 
 	/* No text wrapping in entries */
 	if (strlen(name) > maxlen)
 		name[maxlen] = '\0';
 
-	if (cm == 0)
-		mvprintw(row, 0, "%s%s", active ? CURSR : EMPTY, name);
-	else
-		mvprintw(row, 0, "%s%s%c", active ? CURSR : EMPTY, name, cm);
+	/* The other pane keeps its part of the row */
+	if (w < COLS)
+		mvprintw(row, x, "%*s", w, "");
+	if (cm == 0)
+		mvprintw(row, x, "%s%s", active ? CURSR : EMPTY, name);
+	else
+		mvprintw(row, x, "%s%s%c", active ? CURSR : EMPTY, name, cm);
+	/* Links have no size column, the target gets its room */
+	if (l != NULL && strlen(name) + 4 < maxlen + (own ? 0 : 16))
+		printw(" -> %.*s",
+		    (int)(maxlen + (own ? 0 : 16) - strlen(name) - 4), l->target);
+	if (marked)
+		mvaddch(row, x, SELMARK);
+	if (mark != 0)
+		mvaddch(row, x + 2, mark);
+
+	if (hash && S_ISREG(ent->mode) &&
+	    cksumget(ent->dev, ent->ino, ent->size, ent->t, &sum))
+		mvprintw(row, x + w - 33, "%016llx", sum);
+
+	/* Nothing but the type is known without a stat(2) */
+	if (own && ent->size != NOSIZE) {
+		modestr(ent->mode, perm);
+		col = x + w - 16 - (hash ? 17 : 0) - 29;
+		if (ent->uid == (uid_t)-1) {
+			mvprintw(row, col, "%s", perm);
+		} else {
+			user = idname(0, ent->uid, ubuf, sizeof(ubuf));
+			mvprintw(row, col, "%s %-8.8s %-8.8s", perm, user,
+			    idname(1, ent->gid, gbuf, sizeof(gbuf)));
+		}
+	}
+
+	if ((cm == 0 || cm == '*') && ent->size != NOSIZE)
+	{
+		size = printsize(ent->size);
+		mvprintw(row, x + w - 16, "%s", size);
+		xfree(size);
+	} else if (ent->t == LATE) {
+		/* Asked again in the background */
+		mvprintw(row, x + w - 16, "%13s", "?");
+	}
+	move(row + 1, x);
+
+	xfree(name);
+}
+
+/* Return 1 if listings of `path' may use cached attributes */
+int
+mountcached(char *path)
+{
+	size_t i, len, best = 0;
+	int cached = 0;
+
+	/* The longest match wins so a submount can opt out */
+	for (i = 0; i < LEN(mounts); i++) {
+		len = strlen(mounts[i].path);
+		if (strncmp(path, mounts[i].path, len) != 0 ||
+		    (path[len] != '\0' && path[len] != '/' &&
+		    mounts[i].path[len - 1] != '/'))
+			continue;
+		if (len >= best) {
+			best = len;
+			cached = mounts[i].cached;
+		}
+	}
+	return cached;
+}
+
+/* Fields of the entries a listing needs, ids for the owner columns */
+unsigned int
+statmask(void)
+{
+#ifdef STATX_TYPE
+	return STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE |
+	    STATX_MTIME | (showowner ? STATX_UID | STATX_GID : 0);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Stat `name' in `dirfd' for a listing.  statx(2) is only asked for
+ * the fields in `mask' so network filesystems need not revalidate the
+ * rest, and with `cached' set it takes what the client has cached.
+ * Fields not returned are left 0, ids -1.
+ */
+int
+dentstat(int dirfd, char *name, struct stat *sb, unsigned int mask,
+	 int cached)
+{
+#ifdef STATX_TYPE
+	struct statx stx;
+
+	if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW |
+	    (cached ? AT_STATX_DONT_SYNC : 0), mask, &stx) == -1) {
+		/* Kernels before 4.11 */
+		if (errno == ENOSYS)
+			return fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW);
+		return -1;
+	}
+	memset(sb, 0, sizeof(*sb));
+	sb->st_mode = stx.stx_mode;
+	sb->st_size = stx.stx_size;
+	sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	sb->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	sb->st_ino = stx.stx_ino;
+	sb->st_uid = stx.stx_mask & STATX_UID ? stx.stx_uid : (uid_t)-1;
+	sb->st_gid = stx.stx_mask & STATX_GID ? stx.stx_gid : (gid_t)-1;
+	return 0;
+#else
+	return fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+/* Mode of a readdir(3) type, without permissions */
+mode_t
+dtmode(unsigned char type)
+{
+	switch (type) {
+	case DT_DIR:
+		return S_IFDIR;
+	case DT_LNK:
+		return S_IFLNK;
+	case DT_FIFO:
+		return S_IFIFO;
+	case DT_SOCK:
+		return S_IFSOCK;
+	case DT_CHR:
+		return S_IFCHR;
+	case DT_BLK:
+		return S_IFBLK;
+	default:
+		return S_IFREG;
+	}
+}
+
+void
+dentset(struct entry *ent, struct stat *sb)
+{
+	ent->mode = sb->st_mode;
+	ent->t = sb->st_mtime;
+	ent->tns = sb->st_mtim.tv_nsec;
+	ent->size = sb->st_size;
+	ent->dev = sb->st_dev;
+	ent->ino = sb->st_ino;
+	ent->uid = sb->st_uid;
+	ent->gid = sb->st_gid;
+	if (filemode(sb->st_mode) == 0 || filemode(sb->st_mode) == '*')
+		totalsize += sb->st_size;
+}
+
+struct statres {
+	int j;
+	int ok;
+	struct stat sb;
+};
+
+/* Stat workers left behind on a mount, they hold a pipe open till they exit */
+struct orphan {
+	dev_t dev;
+	int fd;
+} orphans[MAXORPHANS];
+int norphans;
+
+/*
+ * Forget the workers that exited and return 1 if some left behind on
+ * `dev' still run, or if there is no room to track more
+ */
+int
+orphaned(dev_t dev)
+{
+	struct pollfd pfd;
+	int i, r = 0;
+
+	for (i = 0; i < norphans; i++) {
+		pfd.fd = orphans[i].fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 1) {
+			close(orphans[i].fd);
+			orphans[i--] = orphans[--norphans];
+		} else if (orphans[i].dev == dev) {
+			r = 1;
+		}
+	}
+	return r || norphans == MAXORPHANS;
+}
+
+/* Return the milliseconds left of a wait of `ms' from `ts', -1 for none */
+int
+waitleft(struct timespec *ts, int ms)
+{
+	long left;
+
+	if (ms <= 0)
+		return -1;
+	left = ms - usecsince(ts) / 1000;
+	return left > 0 ? left : 0;
+}
+
+/*
+ * Stat the `n' entries of `ents' in `dirfd', split among nworkers
+ * processes that send the results back over a pipe.  Entries that
+ * could not be stat(2)ed keep the type readdir(3) gave.  With statwait
+ * or scanwait set, a worker that answered nothing for statwait and all
+ * of them after scanwait from `start' are left behind, their entries
+ * get a LATE mtime.  While workers left behind on the mount still run,
+ * all entries get one at once, so a dead mount does not collect more
+ * of them stuck in the kernel.  Return how many did.
+ */
+int
+statpar(int dirfd, struct entry *ents, int n, unsigned int mask,
+	int cached, struct timespec *start)
+{
+	struct statres res;
+	struct pollfd pfd;
+	struct timespec *last;
+	struct stat sb, dsb;
+	pid_t pid;
+	ssize_t r;
+	int fd[2], alive[2], *left, nw, i, j, ms, w, busy, wait, status;
+	int late = 0;
+
+	nw = MAX(nworkers, 1);
+	wait = statwait > 0 || scanwait > 0;
+	/* Past the deadline nothing more is asked */
+	if (waitleft(start, scanwait) == 0 || (wait &&
+	    (fstat(dirfd, &dsb) == -1 || orphaned(dsb.st_dev)))) {
+		for (j = 0; j < n; j++)
+			ents[j].t = LATE;
+		return n;
+	}
+	if ((n < 2 * nw || nw < 2) && !wait) {
+		for (j = 0; j < n; j++)
+			if (dentstat(dirfd, ents[j].name, &sb, mask,
+			    cached) == 0)
+				dentset(&ents[j], &sb);
+		return 0;
+	}
+	if (pipe(fd) == -1)
+		return 0;
+	/* Hangs up once the workers are all gone */
+	if (pipe(alive) == -1) {
+		close(fd[0]);
+		close(fd[1]);
+		return 0;
+	}
+	fcntl(alive[0], F_SETFD, FD_CLOEXEC);
+	/*
+	 * The workers are orphaned at once, so one stuck on a dead mount
+	 * is never waited for.  It dies writing to the closed pipe.
+	 */
+	pid = fork();
+	if (pid == 0) {
+		close(fd[0]);
+		close(alive[0]);
+		signal(SIGPIPE, SIG_DFL);
+		for (i = 0; i < nw; i++) {
+			if (fork() != 0)
+				continue;
+			for (j = i; j < n; j += nw) {
+				res.j = j;
+				res.ok = dentstat(dirfd, ents[j].name,
+				    &res.sb, mask, cached) == 0;
+				if (write(fd[1], &res, sizeof(res)) !=
+				    sizeof(res))
+					_exit(1);
+			}
+			_exit(0);
+		}
+		_exit(0);
+	}
+	close(fd[1]);
+	close(alive[1]);
+	if (pid == -1) {
+		close(fd[0]);
+		close(alive[0]);
+		return 0;
+	}
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+
+	/* Entries are late until their worker answers */
+	for (j = 0; j < n; j++)
+		ents[j].t = LATE;
+	left = xmalloc(nw * sizeof(*left));
+	last = xmalloc(nw * sizeof(*last));
+	for (i = 0; i < nw; i++) {
+		left[i] = n / nw + (i < n % nw);
+		clock_gettime(CLOCK_MONOTONIC, &last[i]);
+	}
+	pfd.fd = fd[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		ms = waitleft(start, scanwait);
+		busy = 0;
+		for (i = 0; i < nw; i++) {
+			if (left[i] == 0)
+				continue;
+			/* Stuck on one entry, the rest of its share waits */
+			w = waitleft(&last[i], statwait);
+			if (w == 0) {
+				left[i] = 0;
+				continue;
+			}
+			if (w != -1 && (ms == -1 || w < ms))
+				ms = w;
+			busy = 1;
+		}
+		if (!busy || ms == 0)
+			break;
+		r = poll(&pfd, 1, ms);
+		if (r == -1 && errno != EINTR)
+			break;
+		if (r <= 0)
+			continue;
+		r = read(fd[0], &res, sizeof(res));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r != sizeof(res))
+			break;
+		if (res.j < 0 || res.j >= n)
+			continue;
+		i = res.j % nw;
+		clock_gettime(CLOCK_MONOTONIC, &last[i]);
+		if (left[i] > 0)
+			left[i]--;
+		if (res.ok)
+			dentset(&ents[res.j], &res.sb);
+		else
+			ents[res.j].t = 0;
+	}
+	close(fd[0]);
+	xfree(left);
+	xfree(last);
+	for (j = 0; j < n; j++)
+		if (ents[j].t == LATE)
+			late++;
+	/* Those left behind are watched till they exit */
+	if (late > 0 && wait) {
+		orphans[norphans].dev = dsb.st_dev;
+		orphans[norphans++].fd = alive[0];
+	} else {
+		close(alive[0]);
+	}
+	return late;
+}
+
+/* Pick how to read a directory on a filesystem of `type' */
+enum scan
+scanpolicy(long type)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(fspolicies); i++)
+		if (fspolicies[i].type == type || fspolicies[i].type == 0)
+			return fspolicies[i].scan;
+	return SCAN_SERIAL;
+}
+
+int
+dentfill(char *path, struct entry **dents,
+	 int (*filter)(regex_t *, char *), regex_t *re)
+{
+	DIR *dirp;
+	struct dirent *dp;
+	struct statfs sfs;
+	struct entry *ent;
+	struct stat sb;
+	struct timespec start;
+	unsigned int mask;
+	dev_t dev;
+	int fd, r, cached, first = 0, n = 0;
+
+	totalsize = 0;
+	namebytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fd = pathopen(path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return 0;
+	mask = statmask();
+	cached = mountcached(path);
+	scanfs = fstatfs(fd, &sfs) == 0 ? (long)sfs.f_type : 0;
+	scanhow = scanpolicy(scanfs);
+	/* Entries not stat(2)ed are on the same device */
+	dev = fstat(fd, &sb) == 0 ? sb.st_dev : 0;
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	while ((dp = readdir(dirp)) != NULL) {
+		/* Skip self and parent */
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (filter(re, dp->d_name) == 0)
+			continue;
+		*dents = xrealloc(*dents, (n + 1) * sizeof(**dents));
+		ent = &(*dents)[n];
+		ent->name = xstrdup(dp->d_name);
+		namebytes += strlen(dp->d_name) + 1;
+		ent->mode = dtmode(dp->d_type);
+		ent->t = 0;
+		ent->tns = 0;
+		ent->size = NOSIZE;
+		ent->dev = dev;
+		ent->ino = dp->d_ino;
+		ent->uid = -1;
+		ent->gid = -1;
+		ent->mark = 0;
+		/* Some filesystems cannot tell the type without a stat(2) */
+		if (scanhow == SCAN_SERIAL ||
+		    (scanhow == SCAN_NOSTAT && dp->d_type == DT_UNKNOWN)) {
+			/* Get mode flags, relative to the directory */
+			r = dentstat(fd, dp->d_name, &sb, mask, cached);
+			if (r == -1)
+				printerr(1, "lstat");
+			dentset(ent, &sb);
+		} else if (scanhow == SCAN_NOSTAT && dp->d_type == DT_LNK &&
+		    showlinks) {
+			/*
+			 * Link targets are kept by the inode stat(2) gives,
+			 * which d_ino need not match, as on FUSE
+			 */
+			if (dentstat(fd, dp->d_name, &sb, mask, cached) == 0)
+				dentset(ent, &sb);
+		}
+		n++;
+		/* The workers see the names read up to when they start */
+		if (scanhow != SCAN_PARALLEL)
+			first = n;
+		else if (n - first == SCANBATCH) {
+			nlate += statpar(fd, *dents + first, n - first, mask,
+			    cached, &start);
+			first = n;
+		}
+		/* Over the cap what was scanned goes to disk */
+		if (first == n && memcap > 0 &&
+		    n * sizeof(**dents) + namebytes > memcap) {
+			dentspill(*dents, n);
+			n = first = 0;
+			namebytes = 0;
+		}
+	}
+	if (n > first)
+		nlate += statpar(fd, *dents + first, n - first, mask, cached,
+		    &start);
+
+	/* Should never be null */
+	r = closedir(dirp);
+	if (r == -1)
+		printerr(1, "closedir");
+
+	return n;
+}
+/*
+ * Fill the listing from noiced(1) when it is configured and running.
+ * The daemon is sent the directory open, which shows it we may read it,
+ * and answers with a sealed memfd shared by all clients.  Its records
+ * are mapped and copied into `dents'.  Return -1 to scan in-process
+ * instead.
+ */
+int
+scanfill(char *path, struct entry **dents,
+	 int (*filter)(regex_t *, char *), regex_t *re)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct timeval tv = { 1, 0 };
+	struct sockaddr_un sun;
+	struct dentrec rec;
+	struct msghdr msg;
+	struct iovec iov;
+	struct stat sb;
+	char *map = NULL, *p, *name, c = 0;
+	int s, dir, fd = -1, err = -1, n = 0;
+
+	if (scansock == NULL || strlen(scansock) >= sizeof(sun.sun_path))
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, scansock, sizeof(sun.sun_path));
+	dir = pathopen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir == -1)
+		return -1;
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		close(dir);
+		return -1;
+	}
+	/* A stuck daemon must not hang the browser */
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsg, 0, sizeof(cmsg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	cmsg.h.cmsg_level = SOL_SOCKET;
+	cmsg.h.cmsg_type = SCM_RIGHTS;
+	cmsg.h.cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(&cmsg.h), &dir, sizeof(int));
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == 0 &&
+	    sendmsg(s, &msg, MSG_NOSIGNAL) == 1) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &err;
+		iov.iov_len = sizeof(err);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+		if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) == sizeof(err) &&
+		    err == 0 && msg.msg_controllen >= CMSG_LEN(sizeof(int)) &&
+		    cmsg.h.cmsg_level == SOL_SOCKET &&
+		    cmsg.h.cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(&cmsg.h), sizeof(int));
+	}
+	close(dir);
+	close(s);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 || (sb.st_size > 0 &&
+	    (map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	totalsize = 0;
+	namebytes = 0;
+	for (p = map; p != NULL && map + sb.st_size - p >= (long)sizeof(rec);
+	     p += sizeof(rec) + rec.len) {
+		/* Records are packed, copy out of the unaligned header */
+		memcpy(&rec, p, sizeof(rec));
+		if (rec.len > map + sb.st_size - p - sizeof(rec))
+			break;
+		name = xmalloc(rec.len + 1);
+		memcpy(name, p + sizeof(rec), rec.len);
+		name[rec.len] = '\0';
+		if (filter(re, name) == 0) {
+			xfree(name);
+			continue;
+		}
+		*dents = xrealloc(*dents, (n + 1) * sizeof(**dents));
+		(*dents)[n].name = name;
+		namebytes += rec.len + 1;
+		(*dents)[n].mode = rec.mode;
+		(*dents)[n].t = rec.t;
+		(*dents)[n].tns = rec.tns;
+		(*dents)[n].size = rec.size;
+		(*dents)[n].dev = rec.dev;
+		(*dents)[n].ino = rec.ino;
+		(*dents)[n].uid = rec.uid;
+		(*dents)[n].gid = rec.gid;
+		(*dents)[n].mark = 0;
+		if (filemode(rec.mode) == 0 || filemode(rec.mode) == '*')
+			totalsize += rec.size;
+		n++;
+		if (memcap > 0 && n * sizeof(**dents) + namebytes > memcap) {
+			dentspill(*dents, n);
+			n = 0;
+			namebytes = 0;
+		}
+	}
+	if (map != NULL)
+		munmap(map, sb.st_size);
+	return n;
+}
+
+
+void
+dentfree(struct entry *dents, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		xfree(dents[i].name);
+	xfree(dents);
+}
+
+/*
+ * Front-code the names of `dents', which are in name order, and number
+ * the entries by their place in the pack.  Return NULL if some name is
+ * too long to code.
+ */
+struct pack *
+packdents(struct entry *dents, int n)
+{
+	struct pack *pk;
+	size_t cap = 4096, len, pre, plen = 0;
+	char *prev = "";
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (strlen(dents[i].name) > NAME_MAX)
+			return NULL;
+	pk = xmalloc(sizeof(*pk));
+	pk->buf = xmalloc(cap);
+	pk->len = 0;
+	pk->restart = xmalloc(((n + PACKBLK - 1) / PACKBLK + 1) *
+	    sizeof(*pk->restart));
+	pk->n = n;
+	pk->last = -1;
+	for (i = 0; i < n; i++) {
+		len = strlen(dents[i].name);
+		pre = 0;
+		if (i % PACKBLK == 0)
+			pk->restart[i / PACKBLK] = pk->len;
+		else
+			while (pre < len && pre < plen &&
+			    dents[i].name[pre] == prev[pre])
+				pre++;
+		if (pk->len + 2 + len - pre > cap) {
+			cap = MAX(2 * cap, pk->len + 2 + len - pre);
+			pk->buf = xrealloc(pk->buf, cap);
+		}
+		pk->buf[pk->len++] = pre;
+		pk->buf[pk->len++] = len - pre;
+		memcpy(pk->buf + pk->len, dents[i].name + pre, len - pre);
+		pk->len += len - pre;
+		prev = dents[i].name;
+		plen = len;
+	}
+	pk->buf = xrealloc(pk->buf, pk->len + 1);
+	for (i = 0; i < n; i++) {
+		xfree(dents[i].name);
+		dents[i].id = i;
+	}
+	return pk;
+}
+
+/*
+ * Decode name `id' of `pk'.  Going on from the last name decoded is one
+ * record, so walking a listing in order costs no more than a restart.
+ * The name stays until the next call.
+ */
+char *
+packname(struct pack *pk, size_t id)
+{
+	unsigned char *p;
+	size_t i, off;
+
+	if (id == pk->last)
+		return pk->name;
+	if (pk->last < id && pk->last / PACKBLK == id / PACKBLK) {
+		i = pk->last + 1;
+		off = pk->next;
+	} else {
+		i = id - id % PACKBLK;
+		off = pk->restart[id / PACKBLK];
+	}
+	for (;; i++) {
+		p = pk->buf + off;
+		memcpy(pk->name + p[0], p + 2, p[1]);
+		off += 2 + p[1];
+		if (i == id) {
+			pk->name[p[0] + p[1]] = '\0';
+			break;
+		}
+	}
+	pk->last = id;
+	pk->next = off;
+	return pk->name;
+}
+
+/* Return the name of `ent', copied to `buf' if it is in pack `pk' */
+char *
+entname(struct pack *pk, struct entry *ent, char *buf)
+{
+	if (pk == NULL)
+		return ent->name;
+	return strcpy(buf, packname(pk, ent->id));
+}
+
+/* Return the name of the current entry, see entname() */
+char *
+curname(char *buf)
+{
+	return entname(pack, dentat(spill, dents, cur), buf);
+}
+
+/*
+ * Return the place in listing `dents' of `pk' of the entry called
+ * `name', or -1.  The restart points are searched first, then a block.
+ */
+int
+packfind(struct pack *pk, struct entry *dents, int n, char *name)
+{
+	size_t lo = 0, hi, mid, id;
+	int r;
+
+	if (pk->n == 0)
+		return -1;
+	hi = (pk->n - 1) / PACKBLK;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (strcmp(packname(pk, mid * PACKBLK), name) <= 0)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	for (id = lo * PACKBLK; id < MIN(pk->n, (lo + 1) * PACKBLK); id++) {
+		r = strcmp(packname(pk, id), name);
+		if (r == 0)
+			break;
+		if (r > 0)
+			return -1;
+	}
+	if (id == MIN(pk->n, (lo + 1) * PACKBLK))
+		return -1;
+	/* Entries only ever leave, those left are still in pack order */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dents[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < (size_t)n && dents[lo].id == id ? (int)lo : -1;
+}
+
+void
+packfree(struct pack *pk)
+{
+	if (pk == NULL)
+		return;
+	xfree(pk->buf);
+	xfree(pk->restart);
+	xfree(pk);
+}
+
+/* Copy `pk' for a listing that is about to change */
+struct pack *
+packcopy(struct pack *pk)
+{
+	struct pack *cp;
+	size_t nrestart = (pk->n + PACKBLK - 1) / PACKBLK + 1;
+
+	cp = xmalloc(sizeof(*cp));
+	*cp = *pk;
+	cp->buf = xmalloc(pk->len + 1);
+	memcpy(cp->buf, pk->buf, pk->len);
+	cp->restart = xmalloc(nrestart * sizeof(*cp->restart));
+	memcpy(cp->restart, pk->restart, nrestart * sizeof(*cp->restart));
+	return cp;
+}
+
+
+/* Return a temporary file that is gone once closed */
+FILE *
+spilltemp(void)
+{
+	char *file;
+	FILE *fp = NULL;
+	int fd;
+
+	file = mkpath(xgetenv("TMPDIR", "/tmp"), "noice.XXXXXXXXXX");
+	fd = mkstemp(file);
+	if (fd != -1) {
+		unlink(file);
+		fp = fdopen(fd, "w+");
+		if (fp == NULL)
+			close(fd);
+	}
+	xfree(file);
+	return fp;
+}
+
+/* Append `ent' as a spill record, return its size or 0 on errors */
+size_t
+spillput(FILE *fp, struct entry *ent)
+{
+	struct dentrec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.mode = ent->mode;
+	rec.t = ent->t;
+	rec.tns = ent->tns;
+	rec.size = ent->size;
+	rec.dev = ent->dev;
+	rec.ino = ent->ino;
+	rec.uid = ent->uid;
+	rec.gid = ent->gid;
+	rec.len = strlen(ent->name);
+	if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+	    fwrite(ent->name, 1, rec.len + 1, fp) != rec.len + 1)
+		return 0;
+	return sizeof(rec) + rec.len + 1;
+}
+
+/* Read the record at `off' of `map' into `ent', return the next offset */
+size_t
+spillget(char *map, size_t off, struct entry *ent)
+{
+	struct dentrec rec;
+
+	/* Records are packed, copy out of the unaligned header */
+	memcpy(&rec, map + off, sizeof(rec));
+	ent->name = map + off + sizeof(rec);
+	ent->mode = rec.mode;
+	ent->mark = 0;
+	ent->t = rec.t;
+	ent->tns = rec.tns;
+	ent->size = rec.size;
+	ent->dev = rec.dev;
+	ent->ino = rec.ino;
+	ent->uid = rec.uid;
+	ent->gid = rec.gid;
+	return off + sizeof(rec) + rec.len + 1;
+}
+
+/*
+ * Sort the `n' entries scanned so far and write them to the spill as a
+ * run, freeing their names.  The scan goes on with an empty array.
+ */
+void
+dentspill(struct entry *dents, int n)
+{
+	size_t len;
+	int i;
+
+	if (spill == NULL) {
+		spill = xmalloc(sizeof(*spill));
+		memset(spill, 0, sizeof(*spill));
+		spill->fp = spilltemp();
+		spill->err = spill->fp == NULL;
+	}
+	qsort(dents, n, sizeof(*dents), entrycmp);
+	if (!spill->err) {
+		spill->runs = xrealloc(spill->runs,
+		    (spill->nruns + 1) * sizeof(*spill->runs));
+		spill->runs[spill->nruns++] = spill->len;
+	}
+	for (i = 0; i < n; i++) {
+		if (!spill->err) {
+			len = spillput(spill->fp, &dents[i]);
+			spill->len += len;
+			spill->err = len == 0;
+		}
+		xfree(dents[i].name);
+	}
+}
+
+/*
+ * Spill the last `n' entries and merge the runs into the file that is
+ * browsed.  The runs are as large as memcap allows so there are few of
+ * them, and the smallest head is found by looking at each.
+ */
+int
+spillend(struct entry *dents, int n)
+{
+	struct entry *heads;
+	size_t *offs, *ends, len, outlen = 0;
+	char *runs;
+	FILE *out;
+	int i, k, r = 0;
+
+	dentspill(dents, n);
+	if (spill->err || fflush(spill->fp) == EOF)
+		return -1;
+	runs = mmap(NULL, spill->len, PROT_READ, MAP_SHARED,
+	    fileno(spill->fp), 0);
+	if (runs == MAP_FAILED)
+		return -1;
+	out = spilltemp();
+	if (out == NULL) {
+		munmap(runs, spill->len);
+		return -1;
+	}
+	heads = xmalloc(spill->nruns * sizeof(*heads));
+	offs = xmalloc(spill->nruns * sizeof(*offs));
+	ends = xmalloc(spill->nruns * sizeof(*ends));
+	for (i = 0; i < spill->nruns; i++) {
+		ends[i] = i + 1 < spill->nruns ? spill->runs[i + 1] :
+		    spill->len;
+		offs[i] = spill->runs[i];
+		heads[i].name = NULL;
+		if (offs[i] < ends[i])
+			offs[i] = spillget(runs, offs[i], &heads[i]);
+	}
+
+	/* Each run is sorted, so is the merge */
+	for (;;) {
+		for (i = 0, k = -1; i < spill->nruns; i++)
+			if (heads[i].name != NULL && (k == -1 ||
+			    entrycmp(&heads[i], &heads[k]) < 0))
+				k = i;
+		if (k == -1)
+			break;
+		if (spill->n % SPILLWIN == 0) {
+			spill->index = xrealloc(spill->index,
+			    (spill->n / SPILLWIN + 1) * sizeof(*spill->index));
+			spill->index[spill->n / SPILLWIN] = outlen;
+		}
+		len = spillput(out, &heads[k]);
+		if (len == 0) {
+			r = -1;
+			break;
+		}
+		outlen += len;
+		spill->n++;
+		heads[k].name = NULL;
+		if (offs[k] < ends[k])
+			offs[k] = spillget(runs, offs[k], &heads[k]);
+	}
+	xfree(heads);
+	xfree(offs);
+	xfree(ends);
+	munmap(runs, spill->len);
+	fclose(spill->fp);
+	spill->fp = NULL;
+	if (r == 0 && fflush(out) != EOF && outlen > 0) {
+		spill->map = mmap(NULL, outlen, PROT_READ, MAP_SHARED,
+		    fileno(out), 0);
+		if (spill->map == MAP_FAILED) {
+			spill->map = NULL;
+			r = -1;
+		}
+		spill->size = outlen;
+	}
+	/* The mapping keeps the file */
+	fclose(out);
+	return r;
+}
+
+/*
+ * Return entry `i' of a listing, from `dents' or paged in from `sp' if
+ * it was spilled.  The entry stays until the next page of `sp' is in.
+ */
+struct entry *
+dentat(struct spill *sp, struct entry *dents, int i)
+{
+	size_t off;
+	int j;
+
+	if (sp == NULL)
+		return &dents[i];
+	if (i < sp->wbase || i >= sp->wbase + sp->wn) {
+		sp->wbase = i - i % SPILLWIN;
+		off = sp->index[i / SPILLWIN];
+		sp->wn = MIN(SPILLWIN, sp->n - sp->wbase);
+		for (j = 0; j < sp->wn; j++)
+			off = spillget(sp->map, off, &sp->win[j]);
+	}
+	return &sp->win[i - sp->wbase];
+}
+
+void
+spillfree(struct spill *sp)
+{
+	if (sp == NULL)
+		return;
+	if (sp->fp != NULL)
+		fclose(sp->fp);
+	if (sp->map != NULL)
+		munmap(sp->map, sp->size);
+	xfree(sp->runs);
+	xfree(sp->index);
+	xfree(sp);
+}
+
+/*
+ * Free a listing, its names either one by one or in a pack, or its
+ * spill if it is on disk
+ */
+void
+listfree(struct entry *dents, int n, struct pack *pk, struct spill *sp)
+{
+	if (sp != NULL) {
+		spillfree(sp);
+		xfree(dents);
+	} else if (pk != NULL) {
+		packfree(pk);
+		xfree(dents);
+	} else {
+		dentfree(dents, n);
+	}
+}
+
+char *
+mkpath(char *dir, char *name)
+{
+	char *path;
+	size_t len;
+
+	/* Handle absolute path */
+	if (name[0] == '/')
+		return xstrdup(name);
+	/* No length limit, deep trees are opened a piece at a time */
+	len = strlen(dir);
+	path = xmalloc(len + strlen(name) + 2);
+	memcpy(path, dir, len);
+	/* Handle root case */
+	if (strcmp(dir, "/") != 0)
+		path[len++] = '/';
+	strcpy(path + len, name);
+	return path;
+}
+
+/* Make `s', a malloc(3)-ed string, the current path */
+void
+pathset(char *s)
+{
+	xfree(path);
+	path = s;
+	pathcap = strlen(s) + 1;
+}
+
+/*
+ * Append `name' to the current path in place and return the length
+ * it had, for pathcut().  The buffer only grows, so going up and down
+ * a tree does not allocate.
+ */
+size_t
+pathpush(const char *name)
+{
+	size_t len, old, nlen;
+
+	len = old = strlen(path);
+	nlen = strlen(name);
+	if (len + nlen + 2 > pathcap) {
+		pathcap = MAX(2 * pathcap, len + nlen + 2);
+		path = xrealloc(path, pathcap);
+	}
+	/* Handle root case */
+	if (strcmp(path, "/") != 0)
+		path[len++] = '/';
+	memcpy(path + len, name, nlen + 1);
+	return old;
+}
+
+/* Cut the current path back to `len' bytes */
+void
+pathcut(size_t len)
+{
+	path[len] = '\0';
+}
+
+/* Undo a pathpush() that returned `len', or go back to `save' */
+void
+pathback(size_t len, char *save)
+{
+	if (save != NULL)
+		pathset(save);
+	else
+		pathcut(len);
+}
+
+/* Drop the last component of the current path in place */
+void
+pathpop(void)
+{
+	char *p;
+
+	p = strrchr(path, '/');
+	if (p == NULL)
+		return;
+	/* Handle root case */
+	if (p == path)
+		p++;
+	*p = '\0';
+}
+
+/*
+ * Open `path', one directory at a time with openat(2) when it is too
+ * long for the kernel to take at once
+ */
+int
+pathopen(const char *path, int flags)
+{
+	char name[NAME_MAX + 1];
+	const char *p, *q;
+	size_t len;
+	int fd, nfd;
+
+	if (strlen(path) < PATH_MAX)
+		return open(path, flags);
+	fd = open(path[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY);
+	for (p = path; fd != -1; p = q) {
+		p += strspn(p, "/");
+		q = p + strcspn(p, "/");
+		len = q - p;
+		if (len > NAME_MAX) {
+			close(fd);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+		/* The last one is opened as asked */
+		if (q[strspn(q, "/")] == '\0') {
+			nfd = openat(fd, name, flags);
+			close(fd);
+			return nfd;
+		}
+		nfd = openat(fd, name, O_RDONLY | O_DIRECTORY);
+		close(fd);
+		fd = nfd;
+	}
+	return -1;
+}
+
+/* Return the position of the matching entry or 0 otherwise */
+int
+dentfind(struct entry *dents, int n, struct pack *pk, struct spill *sp,
+    char *cwd, char *path)
+{
+	size_t len;
+	int i, lo, hi, r;
+
+	if (path == NULL)
+		return 0;
+
+	/* Compare names, not paths made for each entry */
+	len = strlen(cwd);
+	if (strncmp(path, cwd, len) != 0)
+		return 0;
+	if (strcmp(cwd, "/") != 0) {
+		if (path[len] != '/')
+			return 0;
+		len++;
+	}
+	DPRINTF_S(path);
+	if (pk != NULL) {
+		i = packfind(pk, dents, n, path + len);
+		return i != -1 ? i : 0;
+	}
+	/* Pages of a spilled listing in name order are bisected */
+	if (sp != NULL && !mtimeorder) {
+		for (lo = 0, hi = n - 1; lo <= hi; ) {
+			i = lo + (hi - lo) / 2;
+			r = strcmp(path + len, dentat(sp, dents, i)->name);
+			if (r == 0)
+				return i;
+			if (r < 0)
+				hi = i - 1;
+			else
+				lo = i + 1;
+		}
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		if (strcmp(dentat(sp, dents, i)->name, path + len) == 0)
+			return i;
+
+	return 0;
+}
+
+/*
+ * Checksums of files keyed by device and inode, valid while size and
+ * mtime match.  Hash jobs append one record per file to cksumfile in
+ * $HOME and the table picks up new records from where it left off.
+ */
+struct cksum *
+cksumfind(dev_t dev, ino_t ino)
+{
+	size_t i;
+
+	if (cksumcap == 0)
+		return NULL;
+	i = ((unsigned long long)dev * 2654435761UL ^ ino) & (cksumcap - 1);
+	while (cksums[i].used &&
+	    (cksums[i].dev != dev || cksums[i].ino != ino))
+		i = (i + 1) & (cksumcap - 1);
+	return &cksums[i];
+}
+
+void
+cksumput(dev_t dev, ino_t ino, off_t size, time_t t, unsigned long long sum)
+{
+	struct cksum *old, *c;
+	size_t i, oldcap;
+
+	/* Keep the load factor under one half */
+	if ((ncksums + 1) * 2 > cksumcap) {
+		old = cksums;
+		oldcap = cksumcap;
+		cksumcap = cksumcap ? cksumcap * 2 : 1024;
+		cksums = xmalloc(cksumcap * sizeof(*cksums));
+		memset(cksums, 0, cksumcap * sizeof(*cksums));
+		for (i = 0; i < oldcap; i++)
+			if (old[i].used)
+				*cksumfind(old[i].dev, old[i].ino) = old[i];
+		xfree(old);
+	}
+	c = cksumfind(dev, ino);
+	if (!c->used)
+		ncksums++;
+	c->dev = dev;
+	c->ino = ino;
+	c->size = size;
+	c->t = t;
+	c->sum = sum;
+	c->used = 1;
+}
+
+/* Return 1 and fill `sum' if there is a valid checksum */
+int
+cksumget(dev_t dev, ino_t ino, off_t size, time_t t, unsigned long long *sum)
+{
+	struct cksum *c;
+
+	c = cksumfind(dev, ino);
+	if (c == NULL || !c->used || c->size != size || c->t != t) {
+		cachemiss++;
+		return 0;
+	}
+	cachehits++;
+	*sum = c->sum;
+	return 1;
+}
+
+char *
+cksumpath(void)
+{
+	char *home;
+
+	home = getenv("HOME");
+	if (home == NULL || home[0] == '\0')
+		return NULL;
+	return mkpath(home, cksumfile);
+}
+
+/* Return the file kept for `dir' in the directory `sub' of $HOME */
+char *
+dirfile(char *sub, char *dir)
+{
+	struct hash h;
+	char *home, *subdir, name[17];
+
+	home = getenv("HOME");
+	if (home == NULL || home[0] == '\0')
+		return NULL;
+	hashinit(&h, 0);
+	hashupdate(&h, dir, strlen(dir));
+	snprintf(name, sizeof(name), "%016llx", hashfinal(&h));
+	subdir = mkpath(home, sub);
+	home = mkpath(subdir, name);
+	xfree(subdir);
+	return home;
+}
+
+/* Rewrite the file with the live records only */
+void
+cksumcompact(char *file)
+{
+	char *tmp;
+	FILE *fp;
+	size_t i;
+
+	tmp = xmalloc(strlen(file) + sizeof(".tmp"));
+	sprintf(tmp, "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		xfree(tmp);
+		return;
+	}
+	for (i = 0; i < cksumcap; i++)
+		if (cksums[i].used)
+			fprintf(fp, "%lu %lu %lld %lld %016llx\n",
+			    (unsigned long)cksums[i].dev,
+			    (unsigned long)cksums[i].ino,
+			    (long long)cksums[i].size,
+			    (long long)cksums[i].t, cksums[i].sum);
+	if (fclose(fp) == 0 && rename(tmp, file) == 0)
+		cksumoff = 0;
+	else
+		unlink(tmp);
+	xfree(tmp);
+}
+
+/* Read the records appended since the last call */
+int
+cksumload(void)
+{
+	char ln[LINE_MAX], *file;
+	unsigned long dev, ino;
+	long long size, t;
+	unsigned long long sum;
+	unsigned long nlines = 0;
+	int first;
+	FILE *fp;
+
+	file = cksumpath();
+	if (file == NULL)
+		return -1;
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		xfree(file);
+		/* Nothing hashed yet */
+		return errno == ENOENT ? 0 : -1;
+	}
+	first = cksumoff == 0;
+	fseeko(fp, cksumoff, SEEK_SET);
+	while (fgets(ln, sizeof(ln), fp) != NULL) {
+		/* Leave a record still being written for next time */
+		if (strchr(ln, '\n') == NULL)
+			break;
+		cksumoff = ftello(fp);
+		nlines++;
+		if (sscanf(ln, "%lu %lu %lld %lld %llx",
+		    &dev, &ino, &size, &t, &sum) == 5)
+			cksumput(dev, ino, size, t, sum);
+	}
+	fclose(fp);
+	/* Superseded records pile up, keep the file bounded */
+	if (first && nlines > 2 * ncksums + 1024 && njobs == 0) {
+		cksumoff = 0;
+		cksumcompact(file);
+		fp = fopen(file, "r");
+		if (fp != NULL) {
+			fseeko(fp, 0, SEEK_END);
+			cksumoff = ftello(fp);
+			fclose(fp);
+		}
+	}
+	xfree(file);
+	return 0;
+}
+
+/*
+ * Symlink targets keyed by device and inode of the link, valid while
+ * its mtime matches.  Links jobs resolve the links of a listing in the
+ * background and the table picks up their records as they come in.
+ */
+struct link *
+linkfind(dev_t dev, ino_t ino)
+{
+	size_t i;
+
+	if (linkcap == 0)
+		return NULL;
+	i = ((unsigned long long)dev * 2654435761UL ^ ino) & (linkcap - 1);
+	while (links[i].used &&
+	    (links[i].dev != dev || links[i].ino != ino))
+		i = (i + 1) & (linkcap - 1);
+	return &links[i];
+}
+
+void
+linkput(struct linkrec *rec, char *target)
+{
+	struct link *old, *l;
+	size_t i, oldcap;
+
+	/* Keep the load factor under one half */
+	if ((nlinks + 1) * 2 > linkcap) {
+		old = links;
+		oldcap = linkcap;
+		linkcap = linkcap ? linkcap * 2 : 256;
+		links = xmalloc(linkcap * sizeof(*links));
+		memset(links, 0, linkcap * sizeof(*links));
+		for (i = 0; i < oldcap; i++)
+			if (old[i].used)
+				*linkfind(old[i].dev, old[i].ino) = old[i];
+		xfree(old);
+	}
+	l = linkfind(rec->dev, rec->ino);
+	if (!l->used)
+		nlinks++;
+	else
+		xfree(l->target);
+	l->dev = rec->dev;
+	l->ino = rec->ino;
+	l->t = rec->t;
+	l->target = xstrdup(target);
+	l->broken = rec->broken;
+	l->used = 1;
+}
+
+/* Return the target of the link `ent' if it was read */
+struct link *
+linkget(struct entry *ent)
+{
+	struct link *l;
+
+	l = linkfind(ent->dev, ent->ino);
+	/* Only a stat(2) gives the mtime to check, NOSIZE has none */
+	if (l == NULL || !l->used ||
+	    (ent->size != NOSIZE && l->t != ent->t))
+		return NULL;
+	return l;
+}
+
+void
+linkclear(void)
+{
+	size_t i;
+
+	for (i = 0; i < linkcap; i++)
+		if (links[i].used)
+			xfree(links[i].target);
+	xfree(links);
+	links = NULL;
+	nlinks = linkcap = 0;
+}
+
+/*
+ * User and group names for the owner columns.  getpwuid(3) can take
+ * long with NSS on a directory server, so a resolver process answers
+ * them one packet each and the names are kept for the session.  Until
+ * a name comes in the id shows as a number.
+ */
+struct idname *
+idfind(unsigned long long key)
+{
+	size_t i;
+
+	if (idcap == 0)
+		return NULL;
+	i = (key * 2654435761UL) & (idcap - 1);
+	while (idnames[i].used && idnames[i].key != key)
+		i = (i + 1) & (idcap - 1);
+	return &idnames[i];
+}
+
+void
+idput(unsigned long long key, char *name)
+{
+	struct idname *old, *e;
+	size_t i, oldcap;
+
+	/* Keep the load factor under one half */
+	if ((nidnames + 1) * 2 > idcap) {
+		old = idnames;
+		oldcap = idcap;
+		idcap = idcap ? idcap * 2 : 64;
+		idnames = xmalloc(idcap * sizeof(*idnames));
+		memset(idnames, 0, idcap * sizeof(*idnames));
+		for (i = 0; i < oldcap; i++)
+			if (old[i].used)
+				*idfind(old[i].key) = old[i];
+		xfree(old);
+	}
+	e = idfind(key);
+	if (!e->used)
+		nidnames++;
+	else
+		xfree(e->name);
+	e->key = key;
+	e->name = name != NULL ? xstrdup(name) : NULL;
+	e->used = 1;
+}
+
+/* Body of the resolver, answer "u ID" and "g ID" with the name */
+void
+idserve(int fd)
+{
+	char buf[LINE_MAX], kind;
+	struct passwd *pw;
+	struct group *gr;
+	unsigned long id;
+	char *name;
+	ssize_t r;
+
+	while ((r = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[r] = '\0';
+		if (sscanf(buf, "%c %lu", &kind, &id) != 2)
+			continue;
+		name = "";
+		if (kind == 'u' && (pw = getpwuid(id)) != NULL)
+			name = pw->pw_name;
+		else if (kind == 'g' && (gr = getgrgid(id)) != NULL)
+			name = gr->gr_name;
+		r = snprintf(buf, sizeof(buf), "%c %lu %s", kind, id, name);
+		if (r < 0 || send(fd, buf, MIN((size_t)r, sizeof(buf) - 1),
+		    MSG_NOSIGNAL) == -1)
+			break;
+	}
+	_exit(0);
+}
+
+void
+idstart(void)
+{
+	int sv[2];
+
+	idpid = -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1)
+		return;
+	idpid = fork();
+	if (idpid == -1) {
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+	if (idpid == 0) {
+		close(sv[0]);
+		idserve(sv[1]);
+	}
+	close(sv[1]);
+	idfd = sv[0];
+	fcntl(idfd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Return the name of user or group `id', its number until known */
+char *
+idname(int group, unsigned long id, char *buf, size_t len)
+{
+	unsigned long long key = (unsigned long long)id << 1 | group;
+	struct idname *e;
+	char req[32];
+	int r;
+
+	snprintf(buf, len, "%lu", id);
+	e = idfind(key);
+	if (e != NULL && e->used)
+		return e->name != NULL && e->name[0] != '\0' ? e->name : buf;
+	if (idpid == 0)
+		idstart();
+	if (idfd == -1)
+		return buf;
+	/* Asked again on the next draw if the resolver is behind */
+	r = snprintf(req, sizeof(req), "%c %lu", group ? 'g' : 'u', id);
+	if (send(idfd, req, r, MSG_NOSIGNAL | MSG_DONTWAIT) == r)
+		idput(key, NULL);
+	return buf;
+}
+
+/* Take the names the resolver sent */
+void
+idpoll(void)
+{
+	char buf[LINE_MAX], name[LINE_MAX], kind;
+	unsigned long id;
+	ssize_t r;
+
+	while ((r = recv(idfd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		buf[r] = '\0';
+		name[0] = '\0';
+		if (sscanf(buf, "%c %lu %s", &kind, &id, name) < 2)
+			continue;
+		idput((unsigned long long)id << 1 | (kind == 'g'), name);
+		idgen++;
+	}
+	/* The resolver is gone, ids stay numbers from now on */
+	if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+		close(idfd);
+		idfd = -1;
+		waitpid(idpid, NULL, WNOHANG);
+	}
+}
+
+void
+idclear(void)
+{
+	size_t i;
+
+	if (idfd != -1)
+		close(idfd);
+	idfd = -1;
+	for (i = 0; i < idcap; i++)
+		if (idnames[i].used)
+			xfree(idnames[i].name);
+	xfree(idnames);
+	idnames = NULL;
+	nidnames = idcap = 0;
+}
+
+/*
+ * Background jobs run in a child process and report back through a
+ * pipe, one short line per record so that writes stay atomic:
+ *   =N  N more bytes to process
+ *   +N  N bytes, or entries for deletes, processed
+ *   -I  name I was removed
+ *   !S  error message S
+ *   *   results saved, the view can be refreshed
+ */
+int jobfd = -1; /* Write end of the progress pipe in a job */
+int countrm;    /* Report removed entries as progress */
+/* Directory created by a copy, so copying into itself terminates */
+dev_t topdev;
+ino_t topino;
+int hastop;
+
+void
+jobsay(int type, const char *fmt, ...)
+{
+	char buf[PIPE_BUF];
+	int r;
+	va_list ap;
+
+	buf[0] = type;
+	va_start(ap, fmt);
+	r = vsnprintf(buf + 1, sizeof(buf) - 2, fmt, ap);
+	va_end(ap);
+	if (r < 0)
+		return;
+	r = MIN((size_t)r + 1, sizeof(buf) - 2);
+	buf[r++] = '\n';
+	write(jobfd, buf, r);
+}
+
+/* Count a removed entry, reporting in batches to keep the pipe quiet */
+void
+rmcount(int flush)
+{
+	static unsigned long pending;
+
+	if (!countrm)
+		return;
+	if (!flush)
+		pending++;
+	if (pending >= 1024 || (flush && pending > 0)) {
+		jobsay('+', "%lu", pending);
+		pending = 0;
+	}
+}
+
+/* Report the error for `name' and fail */
+int
+jobwarn(const char *name)
+{
+	jobsay('!', "%s: %s", name, strerror(errno));
+	return -1;
+}
+
+/* Return the number of bytes under `name' relative to `dirfd' */
+unsigned long long
+treesize(int dirfd, const char *name)
+{
+	unsigned long long size = 0;
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	int fd;
+
+	if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return 0;
+	if (!S_ISDIR(sb.st_mode))
+		return S_ISREG(sb.st_mode) ? sb.st_size : 0;
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return 0;
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		return 0;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		size += treesize(fd, dp->d_name);
+	}
+	closedir(dirp);
+	return size;
+}
+
+/* Copy the contents of `sfd' to `dfd' reporting progress */
+int
+copydata(int sfd, int dfd, const char *name)
+{
+	static char *buf;
+	ssize_t r, w, off;
+
+#ifdef FICLONE
+	/* Share the extents when the filesystem supports reflinks */
+	struct stat sb;
+
+	if (ioctl(dfd, FICLONE, sfd) == 0) {
+		if (fstat(sfd, &sb) == 0)
+			jobsay('+', "%llu", (unsigned long long)sb.st_size);
+		return 0;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	/* Let the kernel move the data without a round trip */
+	while ((r = copy_file_range(sfd, NULL, dfd, NULL, COPYCHUNK, 0)) > 0)
+		jobsay('+', "%zd", r);
+	if (r == 0)
+		return 0;
+	/* Fall back to plain copies across filesystem types */
+	if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+	    errno != EOPNOTSUPP)
+		return jobwarn(name);
+#endif
+	if (buf == NULL)
+		buf = xmalloc(COPYBUF);
+	while ((r = read(sfd, buf, COPYBUF)) > 0) {
+		for (off = 0; off < r; off += w) {
+			w = write(dfd, buf + off, r - off);
+			if (w == -1)
+				return jobwarn(name);
+		}
+		jobsay('+', "%zd", r);
+	}
+	if (r == -1)
+		return jobwarn(name);
+	return 0;
+}
+
+/* Copy `sname' under `sdirfd' to `dname' under `ddirfd' recursively */
+int
+copytree(int sdirfd, const char *sname, int ddirfd, const char *dname)
+{
+	char target[PATH_MAX];
+	struct dirent *dp;
+	struct stat sb;
+	mode_t mode;
+	DIR *dirp;
+	int sfd, dfd, r = 0;
+	ssize_t len;
+
+	if (fstatat(sdirfd, sname, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return jobwarn(sname);
+	/* Do not descend into the copy itself */
+	if (hastop && sb.st_dev == topdev && sb.st_ino == topino)
+		return 0;
+	mode = sb.st_mode & ~S_IFMT;
+
+	switch (sb.st_mode & S_IFMT) {
+	case S_IFDIR:
+		if (mkdirat(ddirfd, dname, mode | S_IRWXU) == -1)
+			return jobwarn(dname);
+		sfd = openat(sdirfd, sname, O_RDONLY | O_DIRECTORY);
+		if (sfd == -1)
+			return jobwarn(sname);
+		dfd = openat(ddirfd, dname, O_RDONLY | O_DIRECTORY);
+		if (dfd == -1) {
+			close(sfd);
+			return jobwarn(dname);
+		}
+		if (!hastop && fstat(dfd, &sb) == 0) {
+			topdev = sb.st_dev;
+			topino = sb.st_ino;
+			hastop = 1;
+		}
+		dirp = fdopendir(sfd);
+		if (dirp == NULL) {
+			close(sfd);
+			close(dfd);
+			return jobwarn(sname);
+		}
+		while ((dp = readdir(dirp)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0
+			    || strcmp(dp->d_name, "..") == 0)
+				continue;
+			if (copytree(sfd, dp->d_name, dfd, dp->d_name) == -1)
+				r = -1;
+		}
+		closedir(dirp);
+		/* Restore the mode after the contents are in */
+		fchmod(dfd, mode);
+		close(dfd);
+		return r;
+	case S_IFLNK:
+		len = readlinkat(sdirfd, sname, target, sizeof(target) - 1);
+		if (len == -1)
+			return jobwarn(sname);
+		target[len] = '\0';
+		if (symlinkat(target, ddirfd, dname) == -1)
+			return jobwarn(dname);
+		return 0;
+	case S_IFREG:
+		sfd = openat(sdirfd, sname, O_RDONLY);
+		if (sfd == -1)
+			return jobwarn(sname);
+		dfd = openat(ddirfd, dname, O_WRONLY | O_CREAT | O_EXCL,
+		    mode);
+		if (dfd == -1) {
+			close(sfd);
+			return jobwarn(dname);
+		}
+		r = copydata(sfd, dfd, sname);
+		close(sfd);
+		if (close(dfd) == -1)
+			r = jobwarn(dname);
+		return r;
+	default:
+		errno = ENOTSUP;
+		return jobwarn(sname);
+	}
+}
+
+/* Remove `name' under `dirfd' recursively */
+int
+removetree(int dirfd, const char *name)
+{
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	int fd, r = 0;
+
+	if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return jobwarn(name);
+	if (!S_ISDIR(sb.st_mode)) {
+		if (unlinkat(dirfd, name, 0) == -1)
+			return jobwarn(name);
+		rmcount(0);
+		return 0;
+	}
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return jobwarn(name);
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		return jobwarn(name);
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (removetree(fd, dp->d_name) == -1)
+			r = -1;
+	}
+	closedir(dirp);
+	if (r == 0 && unlinkat(dirfd, name, AT_REMOVEDIR) == -1)
+		return jobwarn(name);
+	if (r == 0)
+		rmcount(0);
+	return r;
+}
+
+/*
+ * Remove the files at any depth below `fd' whose names, with the inode
+ * of their directory, hash to `slot'.  Directories and whatever fails
+ * are left for the serial pass, which reports the errors.
+ */
+void
+removeslot(int fd, int slot)
+{
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	int dfd, sub;
+
+	/* Own descriptor so the read offset is not shared */
+	dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+	if (dfd == -1)
+		return;
+	dirp = fdopendir(dfd);
+	if (dirp == NULL || fstat(dfd, &sb) == -1) {
+		if (dirp != NULL)
+			closedir(dirp);
+		else
+			close(dfd);
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		/* Every worker walks the whole tree and takes its share */
+		if (dp->d_type == DT_DIR || dp->d_type == DT_UNKNOWN) {
+			sub = openat(dfd, dp->d_name,
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (sub != -1) {
+				removeslot(sub, slot);
+				close(sub);
+				continue;
+			}
+			if (dp->d_type == DT_DIR)
+				continue;
+		}
+		if ((namehash(dp->d_name) + sb.st_ino) % nworkers !=
+		    (unsigned long)slot)
+			continue;
+		if (unlinkat(dfd, dp->d_name, 0) == 0)
+			rmcount(0);
+	}
+	closedir(dirp);
+}
+
+/*
+ * Remove `name' under `dirfd' recursively.  The files at every depth
+ * below it are split among nworkers processes by name hash, so flat
+ * and deep trees alike are removed in parallel.  Whatever the workers
+ * left behind is removed serially, directories last.
+ */
+int
+removepar(int dirfd, const char *name)
+{
+	struct stat sb;
+	pid_t *pids;
+	int fd, i, status;
+
+	if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return jobwarn(name);
+	if (!S_ISDIR(sb.st_mode) || nworkers < 2)
+		return removetree(dirfd, name);
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return jobwarn(name);
+
+	/* Do not count twice what is pending in the workers */
+	rmcount(1);
+	pids = xmalloc(nworkers * sizeof(*pids));
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			removeslot(fd, i);
+			rmcount(1);
+			_exit(0);
+		}
+	}
+	for (i = 0; i < nworkers; i++)
+		if (pids[i] > 0)
+			while (waitpid(pids[i], &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+	xfree(pids);
+	close(fd);
+	return removetree(dirfd, name);
+}
+/*
+ * Rename without replacing an existing target, where renameat2(2) is
+ * missing or the filesystem does not take RENAME_NOREPLACE.  A link
+ * fails if the target exists, directories and filesystems without links
+ * are checked first instead, which leaves a window.
+ */
+int
+renamenew(int sdirfd, const char *sname, int ddirfd, const char *dname)
+{
+	int e;
+
+	if (linkat(sdirfd, sname, ddirfd, dname, 0) == 0) {
+		if (unlinkat(sdirfd, sname, 0) == 0)
+			return 0;
+		e = errno;
+		unlinkat(ddirfd, dname, 0);
+		errno = e;
+		return -1;
+	}
+	if (errno == EEXIST || errno == EXDEV)
+		return -1;
+	if (faccessat(ddirfd, dname, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		return -1;
+	}
+	return renameat(sdirfd, sname, ddirfd, dname);
+}
+
+/* Move within a filesystem by renaming and copy otherwise */
+int
+movetree(int sdirfd, const char *sname, int ddirfd, const char *dname)
+{
+	int r;
+
+#ifdef HAVE_RENAMEAT2
+	/* Never replace an existing target */
+	r = renameat2(sdirfd, sname, ddirfd, dname, RENAME_NOREPLACE);
+	if (r == -1 && (errno == EINVAL || errno == ENOSYS))
+		r = renamenew(sdirfd, sname, ddirfd, dname);
+#else
+	r = renamenew(sdirfd, sname, ddirfd, dname);
+#endif
+	if (r == 0) {
+		jobsay('+', "%llu", treesize(ddirfd, dname));
+		return 0;
+	}
+	if (errno != EXDEV)
+		return jobwarn(sname);
+	if (copytree(sdirfd, sname, ddirfd, dname) == -1)
+		return -1;
+	return removetree(sdirfd, sname);
+}
+
+/* Collect the regular files under `rel', the directory itself if NULL */
+void
+filewalk(int dirfd, char *rel, struct hashfile **files, int *nfiles)
+{
+	struct dirent *dp;
+	struct stat sb;
+	char *sub;
+	DIR *dirp;
+	int fd;
+
+	if (fstatat(dirfd, rel != NULL ? rel : ".", &sb,
+	    AT_SYMLINK_NOFOLLOW) == -1) {
+		jobwarn(rel);
+		return;
+	}
+	if (S_ISREG(sb.st_mode)) {
+		*files = xrealloc(*files, (*nfiles + 1) * sizeof(**files));
+		(*files)[*nfiles].path = xstrdup(rel);
+		(*files)[*nfiles].mode = sb.st_mode;
+		(*files)[*nfiles].dev = sb.st_dev;
+		(*files)[*nfiles].ino = sb.st_ino;
+		(*files)[*nfiles].size = sb.st_size;
+		(*files)[*nfiles].t = sb.st_mtime;
+		(*files)[*nfiles].sum = 0;
+		(*nfiles)++;
+		return;
+	}
+	if (!S_ISDIR(sb.st_mode))
+		return;
+	fd = openat(dirfd, rel != NULL ? rel : ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		jobwarn(rel);
+		return;
+	}
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		jobwarn(rel);
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		sub = rel != NULL ? mkpath(rel, dp->d_name) :
+		    xstrdup(dp->d_name);
+		filewalk(dirfd, sub, files, nfiles);
+		xfree(sub);
+	}
+	closedir(dirp);
+}
+
+/* Write the checksum record of `f' to the cache */
+void
+cksumsave(int cfd, struct hashfile *f)
+{
+	/* One write per record, O_APPEND keeps them whole */
+	dprintf(cfd, "%lu %lu %lld %lld %016llx\n",
+	    (unsigned long)f->dev, (unsigned long)f->ino,
+	    (long long)f->size, (long long)f->t, f->sum);
+}
+
+/*
+ * Worker of hashpar(), hash every nworkers-th file of `idx' starting
+ * at `slot'.  Full checksums also go to the cache if `cfd' is open.
+ */
+void
+hashslot(int dirfd, struct hashfile *files, int *idx, int nidx,
+	 off_t limit, int slot, int out, int cfd)
+{
+	struct hashres res;
+	struct hashfile *f;
+	struct hash h;
+	char *buf;
+	off_t left;
+	ssize_t r;
+	int fd, j;
+
+	buf = xmalloc(HASHBUF);
+	for (j = slot; j < nidx; j += nworkers) {
+		f = &files[idx[j]];
+		res.j = j;
+		res.ok = 0;
+		fd = openat(dirfd, f->path, O_RDONLY);
+		if (fd == -1) {
+			jobwarn(f->path);
+			write(out, &res, sizeof(res));
+			continue;
+		}
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd, 0, limit, POSIX_FADV_SEQUENTIAL);
+#endif
+		hashinit(&h, 0);
+		left = limit > 0 ? limit : f->size;
+		/* Empty files are not read at all */
+		r = 0;
+		while (left > 0 &&
+		    (r = read(fd, buf, MIN(HASHBUF, left))) > 0) {
+			hashupdate(&h, buf, r);
+			jobsay('+', "%zd", r);
+			/* Read to the end even if the file grew */
+			if (limit > 0)
+				left -= r;
+		}
+		close(fd);
+		if (r == -1) {
+			jobwarn(f->path);
+			write(out, &res, sizeof(res));
+			continue;
+		}
+		res.ok = 1;
+		res.sum = hashfinal(&h);
+		write(out, &res, sizeof(res));
+		/* Only complete checksums are worth keeping */
+		if (cfd != -1 && (limit == 0 || f->size <= limit)) {
+			f->sum = res.sum;
+			cksumsave(cfd, f);
+		}
+	}
+	xfree(buf);
+}
+
+/*
+ * Checksum the files of `idx' into their sum fields, reading at most
+ * `limit' bytes of each or all if 0.  The files are split among
+ * nworkers processes which send the results back over a pipe.  Files
+ * that could not be read are left with ok unset.
+ */
+void
+hashpar(int dirfd, struct hashfile *files, int *idx, int nidx, off_t limit,
+	int cfd)
+{
+	struct hashres res;
+	pid_t *pids;
+	int fd[2], i, status;
+
+	for (i = 0; i < nidx; i++)
+		files[idx[i]].ok = 0;
+	if (pipe(fd) == -1) {
+		jobwarn("pipe");
+		return;
+	}
+	pids = xmalloc(nworkers * sizeof(*pids));
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			close(fd[0]);
+			hashslot(dirfd, files, idx, nidx, limit, i, fd[1], cfd);
+			_exit(0);
+		}
+		if (pids[i] == -1)
+			jobwarn("fork");
+	}
+	close(fd[1]);
+	while (read(fd[0], &res, sizeof(res)) == sizeof(res)) {
+		if (!res.ok || res.j < 0 || res.j >= nidx)
+			continue;
+		files[idx[res.j]].sum = res.sum;
+		files[idx[res.j]].ok = 1;
+	}
+	close(fd[0]);
+	for (i = 0; i < nworkers; i++)
+		if (pids[i] > 0)
+			while (waitpid(pids[i], &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+	xfree(pids);
+}
+
+/* Body of a hash job */
+int
+hashrun(int dirfd, char **names, int nnames)
+{
+	struct hashfile *files = NULL;
+	unsigned long long total = 0, sum;
+	char *file;
+	int *idx;
+	int nfiles = 0, nidx = 0, cfd, i, r = 0;
+
+	file = cksumpath();
+	if (file == NULL) {
+		jobsay('!', "HOME is not set");
+		return -1;
+	}
+	cfd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (cfd == -1)
+		return jobwarn(file);
+
+	for (i = 0; i < nnames; i++)
+		filewalk(dirfd, names[i], &files, &nfiles);
+	/* Skip what is cached and hard links seen before */
+	idx = xmalloc((nfiles + 1) * sizeof(*idx));
+	for (i = 0; i < nfiles; i++) {
+		if (cksumget(files[i].dev, files[i].ino, files[i].size,
+		    files[i].t, &sum))
+			continue;
+		cksumput(files[i].dev, files[i].ino, files[i].size,
+		    files[i].t, 0);
+		idx[nidx++] = i;
+		total += files[i].size;
+	}
+	jobsay('=', "%llu", total);
+
+	hashpar(dirfd, files, idx, nidx, 0, cfd);
+	for (i = 0; i < nidx; i++)
+		if (!files[idx[i]].ok)
+			r = -1;
+	return r;
+}
+
+/*
+ * Worker of a links job, read every `step'-th link of `names' starting
+ * at `slot' and follow it to see if it resolves
+ */
+void
+linkslot(int dirfd, char **names, int nnames, int slot, int step, int out)
+{
+	union {
+		struct linkrec rec;
+		char buf[sizeof(struct linkrec) + PATH_MAX];
+	} u;
+	struct stat sb;
+	ssize_t r;
+	int j, k = 0;
+
+	for (j = slot; j < nnames; j += step) {
+		/* Gone or replaced since the scan, the next one sees it */
+		if (fstatat(dirfd, names[j], &sb, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    !S_ISLNK(sb.st_mode))
+			continue;
+		memset(&u.rec, 0, sizeof(u.rec));
+		u.rec.dev = sb.st_dev;
+		u.rec.ino = sb.st_ino;
+		u.rec.t = sb.st_mtime;
+		r = readlinkat(dirfd, names[j], u.buf + sizeof(u.rec),
+		    PATH_MAX);
+		u.rec.len = r > 0 ? r : 0;
+		u.rec.broken = fstatat(dirfd, names[j], &sb, 0) == -1;
+		/* One write per record, O_APPEND keeps them whole */
+		write(out, &u, sizeof(u.rec) + u.rec.len);
+		if (++k == LINKBATCH) {
+			jobsay('+', "%d", k);
+			k = 0;
+		}
+	}
+	if (k > 0)
+		jobsay('+', "%d", k);
+}
+
+/*
+ * Worker of a stat job, append a record per answer for every `step'-th
+ * entry of `names' starting at `slot'.  Those that fail get a 0 mode.
+ */
+void
+statslot(int dirfd, char **names, int nnames, int slot, int step, int out)
+{
+	union {
+		struct dentrec rec;
+		char buf[sizeof(struct dentrec) + NAME_MAX];
+	} u;
+	struct stat sb;
+	int j;
+
+	for (j = slot; j < nnames; j += step) {
+		memset(&u.rec, 0, sizeof(u.rec));
+		if (fstatat(dirfd, names[j], &sb, AT_SYMLINK_NOFOLLOW) == -1)
+			memset(&sb, 0, sizeof(sb));
+		u.rec.mode = sb.st_mode;
+		u.rec.t = sb.st_mtime;
+		u.rec.tns = sb.st_mtim.tv_nsec;
+		u.rec.size = sb.st_size;
+		u.rec.dev = sb.st_dev;
+		u.rec.ino = sb.st_ino;
+		u.rec.uid = sb.st_uid;
+		u.rec.gid = sb.st_gid;
+		u.rec.len = strlen(names[j]);
+		memcpy(u.buf + sizeof(u.rec), names[j], u.rec.len);
+		/* One write per record, O_APPEND keeps them whole */
+		write(out, &u, sizeof(u.rec) + u.rec.len);
+		jobsay('+', "1");
+	}
+}
+
+/*
+ * Body of the links and stat jobs, `slot' appends records for `names'
+ * to `dest'.  Lists of `min' names or more are split among nworkers
+ * processes.
+ */
+int
+slotrun(int dirfd, char **names, int nnames, char *dest, int min,
+	void (*slot)(int, char **, int, int, int, int))
+{
+	pid_t *pids;
+	int fd, i, status;
+
+	fd = open(dest, O_WRONLY | O_APPEND);
+	if (fd == -1)
+		return jobwarn(dest);
+	if (nnames < min || nworkers < 2) {
+		slot(dirfd, names, nnames, 0, 1, fd);
+		close(fd);
+		return 0;
+	}
+	pids = xmalloc(nworkers * sizeof(*pids));
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			slot(dirfd, names, nnames, i, nworkers, fd);
+			_exit(0);
+		}
+		if (pids[i] == -1)
+			jobwarn("fork");
+	}
+	close(fd);
+	for (i = 0; i < nworkers; i++)
+		if (pids[i] > 0)
+			while (waitpid(pids[i], &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+	xfree(pids);
+	return 0;
+}
+
+/* Order by size, largest first, then checksum and path */
+int
+dupcmp(const void *va, const void *vb)
+{
+	const struct hashfile *a = va, *b = vb;
+
+	if (a->size != b->size)
+		return a->size < b->size ? 1 : -1;
+	if (a->sum != b->sum)
+		return a->sum < b->sum ? -1 : 1;
+	return strcmp(a->path, b->path);
+}
+
+int
+inocmp(const void *va, const void *vb)
+{
+	const struct hashfile *a = va, *b = vb;
+
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	return 0;
+}
+
+/* Sort and keep the files that share size and checksum with another */
+int
+dupkeep(struct hashfile *files, int nfiles)
+{
+	int i, j, k = 0;
+
+	qsort(files, nfiles, sizeof(*files), dupcmp);
+	for (i = 0; i < nfiles; i = j) {
+		for (j = i + 1; j < nfiles; j++)
+			if (files[j].size != files[i].size ||
+			    files[j].sum != files[i].sum)
+				break;
+		if (j - i > 1) {
+			memmove(&files[k], &files[i], (j - i) * sizeof(*files));
+			k += j - i;
+			continue;
+		}
+		xfree(files[i].path);
+	}
+	return k;
+}
+
+/* Drop the files that could not be hashed */
+int
+dupok(struct hashfile *files, int nfiles)
+{
+	int i, k = 0;
+
+	for (i = 0; i < nfiles; i++)
+		if (files[i].ok)
+			files[k++] = files[i];
+		else
+			xfree(files[i].path);
+	return k;
+}
+
+/*
+ * Body of a duplicate search.  Files are grouped by size, then by a
+ * checksum of their first DUPPREFIX bytes and last by a full checksum,
+ * dropping singletons after each stage so most files are never read.
+ * Hard links count as one file.  The groups are written to `out'.
+ */
+int
+dupsrun(int dirfd, int out)
+{
+	struct hashfile *files = NULL;
+	struct entry ent;
+	unsigned long long total;
+	char *file;
+	int *idx;
+	int nfiles = 0, nidx, cfd = -1, i, k;
+
+	file = cksumpath();
+	if (file != NULL)
+		cfd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+	filewalk(dirfd, NULL, &files, &nfiles);
+	qsort(files, nfiles, sizeof(*files), inocmp);
+	for (i = k = 0; i < nfiles; i++) {
+		if (files[i].size == 0 ||
+		    (k > 0 && inocmp(&files[k - 1], &files[i]) == 0)) {
+			xfree(files[i].path);
+			continue;
+		}
+		files[k++] = files[i];
+	}
+	nfiles = dupkeep(files, k);
+	idx = xmalloc((nfiles + 1) * sizeof(*idx));
+
+	/* Same size, compare the beginnings */
+	for (i = total = 0; i < nfiles; i++) {
+		idx[i] = i;
+		total += MIN(files[i].size, DUPPREFIX);
+	}
+	jobsay('=', "%llu", total);
+	hashpar(dirfd, files, idx, nfiles, DUPPREFIX, cfd);
+	nfiles = dupkeep(files, dupok(files, nfiles));
+
+	/* Same beginning, small files are hashed in full already */
+	for (i = nidx = total = 0; i < nfiles; i++) {
+		if (files[i].size <= DUPPREFIX ||
+		    cksumget(files[i].dev, files[i].ino, files[i].size,
+		    files[i].t, &files[i].sum))
+			continue;
+		idx[nidx++] = i;
+		total += files[i].size;
+	}
+	jobsay('=', "%llu", total);
+	hashpar(dirfd, files, idx, nidx, 0, cfd);
+	for (i = 0; i < nfiles; i++)
+		if (files[i].size <= DUPPREFIX)
+			files[i].ok = 1;
+	nfiles = dupkeep(files, dupok(files, nfiles));
+
+	for (i = 0; i < nfiles; i++) {
+		ent.name = files[i].path;
+		ent.mode = files[i].mode;
+		ent.t = files[i].t;
+		ent.tns = 0;
+		ent.size = files[i].size;
+		ent.dev = files[i].dev;
+		ent.ino = files[i].ino;
+		/* The view stats the files again for their owners */
+		ent.uid = -1;
+		ent.gid = -1;
+		ent.mark = 0;
+		if (dentwrite(out, &ent) == -1)
+			return jobwarn("write");
+	}
+	return 0;
+}
+
+/* Rank by mtime instead of size in largest and recent jobs */
+int rankbytime;
+
+int
+rankless(struct entry *a, struct entry *b)
+{
+	if (rankbytime)
+		return MTIMEKEY(a) < MTIMEKEY(b);
+	return a->size < b->size;
+}
+
+/* Highest ranked first, for the view file */
+int
+rankcmp(const void *va, const void *vb)
+{
+	struct entry *a = (struct entry *)va, *b = (struct entry *)vb;
+
+	if (rankless(b, a))
+		return -1;
+	if (rankless(a, b))
+		return 1;
+	return strcmp(a->name, b->name);
+}
+
+/*
+ * Keep `ent' if it is among the topk highest ranked seen so far, the
+ * lowest of which is at the root of the min-heap `heap'.  Takes over
+ * the name, return 1 if kept.
+ */
+int
+rankput(struct entry *heap, int *n, struct entry *ent)
+{
+	struct entry tmp;
+	int i, c;
+
+	if (*n < topk) {
+		for (i = (*n)++; i > 0 && rankless(ent, &heap[(i - 1) / 2]);
+		     i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = *ent;
+		return 1;
+	}
+	if (!rankless(&heap[0], ent)) {
+		xfree(ent->name);
+		return 0;
+	}
+	xfree(heap[0].name);
+	heap[0] = *ent;
+	for (i = 0; (c = 2 * i + 1) < *n; i = c) {
+		if (c + 1 < *n && rankless(&heap[c + 1], &heap[c]))
+			c++;
+		if (!rankless(&heap[c], &heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+	}
+	return 1;
+}
+
+/*
+ * Rank the files in the directory `rel' under `dirfd', the top if NULL,
+ * whose names with the inode of their directory hash to `slot', and
+ * send the ones kept to `out'.  Every worker walks the whole tree and
+ * only stats its share, the first one reports the errors.
+ */
+void
+rankwalk(int dirfd, char *rel, int slot, struct entry *heap, int *n,
+	 int out)
+{
+	static unsigned long seen;
+	struct dirent *dp;
+	struct entry ent;
+	struct stat sb, dsb;
+	char *sub;
+	DIR *dirp;
+	int fd, known;
+
+	fd = openat(dirfd, rel != NULL ? rel : ".",
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1) {
+		if (slot == 0)
+			jobwarn(rel != NULL ? rel : ".");
+		return;
+	}
+	dirp = fdopendir(fd);
+	if (dirp == NULL || fstat(fd, &dsb) == -1) {
+		if (dirp != NULL)
+			closedir(dirp);
+		else
+			close(fd);
+		if (slot == 0)
+			jobwarn(rel != NULL ? rel : ".");
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		sub = rel != NULL ? mkpath(rel, dp->d_name) :
+		    xstrdup(dp->d_name);
+		known = 0;
+		/* Without a type all workers need to look */
+		if (dp->d_type == DT_UNKNOWN) {
+			known = fstatat(fd, dp->d_name, &sb,
+			    AT_SYMLINK_NOFOLLOW) == 0;
+			if (!known && slot == 0)
+				jobwarn(sub);
+			if (!known)
+				goto next;
+		}
+		if (known ? S_ISDIR(sb.st_mode) : dp->d_type == DT_DIR) {
+			rankwalk(dirfd, sub, slot, heap, n, out);
+			goto next;
+		}
+		if ((namehash(dp->d_name) + dsb.st_ino) % nworkers !=
+		    (unsigned long)slot)
+			goto next;
+		if (!known && fstatat(fd, dp->d_name, &sb,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			jobwarn(sub);
+			goto next;
+		}
+		if (!S_ISREG(sb.st_mode))
+			goto next;
+		ent.name = sub;
+		ent.mode = sb.st_mode;
+		ent.t = sb.st_mtime;
+		ent.tns = sb.st_mtim.tv_nsec;
+		ent.size = sb.st_size;
+		ent.dev = sb.st_dev;
+		ent.ino = sb.st_ino;
+		ent.uid = sb.st_uid;
+		ent.gid = sb.st_gid;
+		ent.mark = 0;
+		if (++seen % 1024 == 0)
+			jobsay('+', "%d", 1024);
+		/* The name is kept in the heap or freed there */
+		if (rankput(heap, n, &ent) && dentwrite(out, &ent) == -1)
+			jobwarn("write");
+		continue;
+next:
+		xfree(sub);
+	}
+	closedir(dirp);
+}
+
+/* Worker of a rank job, ranks the files of `slot' */
+void
+rankslot(int fd, int slot, int out)
+{
+	struct entry *heap;
+	int n = 0;
+
+	heap = xmalloc(topk * sizeof(*heap));
+	rankwalk(fd, NULL, slot, heap, &n, out);
+}
+
+/* Write the ranked entries to the view file `dest' in one go */
+int
+ranksave(struct entry *heap, int n, char *dest)
+{
+	struct entry *ents;
+	char *tmp;
+	int fd, i, r = 0;
+
+	ents = xmalloc((n + 1) * sizeof(*ents));
+	memcpy(ents, heap, n * sizeof(*ents));
+	qsort(ents, n, sizeof(*ents), rankcmp);
+	tmp = xmalloc(strlen(dest) + sizeof(".new"));
+	sprintf(tmp, "%s.new", dest);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		r = jobwarn(tmp);
+		goto out;
+	}
+	for (i = 0; i < n && r == 0; i++)
+		r = dentwrite(fd, &ents[i]);
+	close(fd);
+	/* The listing never sees a partial file */
+	if (r == -1 || rename(tmp, dest) == -1) {
+		r = jobwarn(dest);
+		unlink(tmp);
+	}
+out:
+	xfree(tmp);
+	xfree(ents);
+	return r;
+}
+
+/* Read exactly `len' bytes unless the writer is gone */
+int
+readfull(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+	size_t off = 0;
+
+	while (off < len) {
+		r = read(fd, (char *)buf + off, len - off);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		off += r;
+	}
+	return 0;
+}
+
+/*
+ * Body of a largest or recent files job.  The entries under `dirfd'
+ * are split among nworkers processes by name hash, each keeping the
+ * topk highest ranked files it saw in a heap and sending the files
+ * that enter it.  Their streams are merged into one more heap here,
+ * which is saved to `dest' twice a second while it changes so the
+ * view fills in as the walk goes.
+ */
+int
+rankrun(int dirfd, char *dest)
+{
+	struct pollfd *pfds;
+	struct dentrec rec;
+	struct entry ent, *heap;
+	struct timespec ts;
+	pid_t *pids;
+	int fd[2], i, n = 0, nopen = 0, changed = 0, status, r = 0;
+
+	heap = xmalloc(topk * sizeof(*heap));
+	pids = xmalloc(nworkers * sizeof(*pids));
+	pfds = xmalloc(nworkers * sizeof(*pfds));
+	for (i = 0; i < nworkers; i++) {
+		pfds[i].fd = -1;
+		pfds[i].events = POLLIN;
+		pids[i] = -1;
+		if (pipe(fd) == -1) {
+			jobwarn("pipe");
+			continue;
+		}
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			close(fd[0]);
+			rankslot(dirfd, i, fd[1]);
+			_exit(0);
+		}
+		close(fd[1]);
+		if (pids[i] == -1) {
+			close(fd[0]);
+			jobwarn("fork");
+			continue;
+		}
+		pfds[i].fd = fd[0];
+		nopen++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	while (nopen > 0) {
+		if (poll(pfds, nworkers, 500) == -1 && errno != EINTR)
+			break;
+		for (i = 0; i < nworkers; i++) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0)
+				continue;
+			/* A record is sent whole, read it whole */
+			ent.name = NULL;
+			if (readfull(pfds[i].fd, &rec, sizeof(rec)) == 0 &&
+			    rec.len <= PATH_MAX) {
+				ent.name = xmalloc(rec.len + 1);
+				if (readfull(pfds[i].fd, ent.name,
+				    rec.len) == -1) {
+					xfree(ent.name);
+					ent.name = NULL;
+				}
+			}
+			/* Done or gone */
+			if (ent.name == NULL) {
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				nopen--;
+				continue;
+			}
+			ent.name[rec.len] = '\0';
+			ent.mode = rec.mode;
+			ent.t = rec.t;
+			ent.tns = rec.tns;
+			ent.size = rec.size;
+			ent.dev = rec.dev;
+			ent.ino = rec.ino;
+			ent.uid = rec.uid;
+			ent.gid = rec.gid;
+			ent.mark = rec.mark;
+			changed |= rankput(heap, &n, &ent);
+		}
+		if (changed && usecsince(&ts) >= 500000) {
+			if (ranksave(heap, n, dest) == 0)
+				jobsay('*', "");
+			changed = 0;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+		}
+	}
+	for (i = 0; i < nworkers; i++)
+		if (pids[i] > 0)
+			while (waitpid(pids[i], &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+	r = ranksave(heap, n, dest);
+	for (i = 0; i < n; i++)
+		xfree(heap[i].name);
+	xfree(heap);
+	xfree(pids);
+	xfree(pfds);
+	return r;
+}
+
+/*
+ * Compare paths a component at a time, so a tree walked in name order
+ * comes out sorted
+ */
+int
+pathcmp(const char *a, const char *b)
+{
+	for (; *a == *b; a++, b++)
+		if (*a == '\0')
+			return 0;
+	if (*a == '\0' || (*a == '/' && *b != '\0'))
+		return -1;
+	if (*b == '\0' || *b == '/')
+		return 1;
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+/* Push the listing of the directory `rel' of a walk, sorted by name */
+void
+walkpush(struct walk *w, char *rel)
+{
+	struct frame *f;
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	int fd;
+
+	w->st = xrealloc(w->st, (w->nst + 1) * sizeof(*w->st));
+	f = &w->st[w->nst++];
+	f->rel = rel != NULL ? xstrdup(rel) : NULL;
+	f->ents = NULL;
+	f->n = f->i = 0;
+	fd = openat(w->dirfd, rel != NULL ? rel : ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		jobwarn(rel != NULL ? rel : ".");
+		return;
+	}
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		jobwarn(rel != NULL ? rel : ".");
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (fstatat(fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		f->ents = xrealloc(f->ents, (f->n + 1) * sizeof(*f->ents));
+		f->ents[f->n].name = xstrdup(dp->d_name);
+		f->ents[f->n].mode = sb.st_mode;
+		f->ents[f->n].mark = 0;
+		f->ents[f->n].t = sb.st_mtime;
+		f->ents[f->n].tns = sb.st_mtim.tv_nsec;
+		f->ents[f->n].size = sb.st_size;
+		f->ents[f->n].dev = sb.st_dev;
+		f->ents[f->n].ino = sb.st_ino;
+		f->ents[f->n].uid = sb.st_uid;
+		f->ents[f->n].gid = sb.st_gid;
+		f->n++;
+	}
+	closedir(dirp);
+	qsort(f->ents, f->n, sizeof(*f->ents), entrycmp);
+}
+
+void
+walkpop(struct walk *w)
+{
+	struct frame *f = &w->st[--w->nst];
+
+	dentfree(f->ents, f->n);
+	xfree(f->rel);
+}
+
+/* Read the next snapshot record into the walk, 0 at the end */
+int
+snapread(struct walk *w)
+{
+	struct dentrec rec;
+
+	if (fread(&rec, sizeof(rec), 1, w->fp) != 1 || rec.len > PATH_MAX)
+		return 0;
+	w->ent.name = xmalloc(rec.len + 1);
+	if (fread(w->ent.name, 1, rec.len, w->fp) != rec.len) {
+		xfree(w->ent.name);
+		w->ent.name = NULL;
+		return 0;
+	}
+	w->ent.name[rec.len] = '\0';
+	w->ent.mode = rec.mode;
+	w->ent.mark = 0;
+	w->ent.t = rec.t;
+	w->ent.tns = rec.tns;
+	w->ent.size = rec.size;
+	w->ent.dev = rec.dev;
+	w->ent.ino = rec.ino;
+	w->ent.uid = rec.uid;
+	w->ent.gid = rec.gid;
+	return 1;
+}
+
+/*
+ * Step to the next entry of a walk in name order, below the current
+ * one first if it is a directory and `descend' is set.  The name of
+ * the entry is its path.  Return 0 at the end.
+ */
+int
+walknext(struct walk *w, int descend)
+{
+	struct frame *f;
+	struct entry *e;
+	char *prev;
+	size_t len;
+	int isdir;
+
+	prev = w->ent.name;
+	w->ent.name = NULL;
+	isdir = prev != NULL && S_ISDIR(w->ent.mode);
+	if (w->fp != NULL) {
+		/* Snapshots hold the whole tree, skip what is not wanted */
+		len = prev != NULL ? strlen(prev) : 0;
+		while (snapread(w) && isdir && !descend &&
+		    strncmp(w->ent.name, prev, len) == 0 &&
+		    w->ent.name[len] == '/') {
+			xfree(w->ent.name);
+			w->ent.name = NULL;
+		}
+		xfree(prev);
+		return w->ent.name != NULL;
+	}
+	if (isdir && descend)
+		walkpush(w, prev);
+	xfree(prev);
+	while (w->nst > 0) {
+		f = &w->st[w->nst - 1];
+		if (f->i == f->n) {
+			walkpop(w);
+			continue;
+		}
+		e = &f->ents[f->i++];
+		w->ent = *e;
+		w->ent.name = f->rel != NULL ? mkpath(f->rel, e->name) :
+		    xstrdup(e->name);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the header of snapshot `snap' from `fp'.  Records laid out by
+ * another version would be read as garbage, fail on those.
+ */
+int
+snaphead(FILE *fp, char *snap)
+{
+	char magic[sizeof(SNAPMAGIC) - 1];
+
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+	    memcmp(magic, SNAPMAGIC, sizeof(magic)) != 0) {
+		jobsay('!', "%s: not a snapshot of this version", snap);
+		return -1;
+	}
+	return 0;
+}
+
+/* Start a walk of `dirfd', or of the snapshot `snap' if not NULL */
+int
+walkinit(struct walk *w, int dirfd, char *snap)
+{
+	memset(w, 0, sizeof(*w));
+	w->dirfd = dirfd;
+	if (snap != NULL) {
+		w->fp = fopen(snap, "r");
+		if (w->fp == NULL)
+			return jobwarn(snap);
+		return snaphead(w->fp, snap);
+	}
+	walkpush(w, NULL);
+	return 0;
+}
+
+void
+walkfree(struct walk *w)
+{
+	while (w->nst > 0)
+		walkpop(w);
+	xfree(w->st);
+	xfree(w->ent.name);
+	if (w->fp != NULL)
+		fclose(w->fp);
+}
+
+/* Body of a snapshot job, the tree under `dirfd' goes to `dest' */
+int
+snaprun(int dirfd, char *dest)
+{
+	struct walk w;
+	unsigned long seen = 0;
+	char *tmp;
+	int fd, r = 0;
+
+	tmp = xmalloc(strlen(dest) + sizeof(".new"));
+	sprintf(tmp, "%s.new", dest);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		r = jobwarn(tmp);
+		xfree(tmp);
+		return r;
+	}
+	if (write(fd, SNAPMAGIC, sizeof(SNAPMAGIC) - 1) == -1)
+		r = jobwarn(tmp);
+	walkinit(&w, dirfd, NULL);
+	while (r == 0 && walknext(&w, 1)) {
+		if (dentwrite(fd, &w.ent) == -1)
+			r = jobwarn(tmp);
+		if (++seen % 1024 == 0)
+			jobsay('+', "%d", 1024);
+	}
+	walkfree(&w);
+	close(fd);
+	/* An old snapshot stays until the new one is whole */
+	if (r == -1 || rename(tmp, dest) == -1) {
+		r = jobwarn(dest);
+		unlink(tmp);
+	}
+	xfree(tmp);
+	return r;
+}
+
+/*
+ * Worker of a compare job.  Both sides are walked once in name order
+ * and merged: entries on one side only and files that differ go to
+ * `out' in that order.  A directory on one side only is reported, not
+ * walked.  Workers share the top directories by name hash and the
+ * first one reports the top entries.
+ */
+void
+diffslot(int dirfd, char *rdir, char *snap, int deep, int slot, int out)
+{
+	struct walk l, r;
+	struct entry *e;
+	unsigned long seen = 0;
+	int okl, okr, c, down, top;
+
+	if (walkinit(&l, dirfd, NULL) == -1)
+		return;
+	if (walkinit(&r, snap != NULL ? -1 :
+	    pathopen(rdir, O_RDONLY | O_DIRECTORY), snap) == -1) {
+		walkfree(&l);
+		return;
+	}
+	okl = walknext(&l, 0);
+	okr = walknext(&r, 0);
+	while (okl || okr) {
+		if (!okl)
+			c = 1;
+		else if (!okr)
+			c = -1;
+		else
+			c = pathcmp(l.ent.name, r.ent.name);
+		e = c > 0 ? &r.ent : &l.ent;
+		top = strchr(e->name, '/') == NULL;
+		down = 0;
+		if (c < 0)
+			e->mark = ONLYMARK;
+		else if (c > 0)
+			e->mark = GONEMARK;
+		else {
+			e->mark = dentdiffer(&l.ent, &r.ent) ? DIFFMARK : 0;
+			down = deep && S_ISDIR(l.ent.mode) &&
+			    S_ISDIR(r.ent.mode) &&
+			    (!top || namehash(e->name) % nworkers ==
+			    (unsigned long)slot);
+		}
+		if (e->mark != 0 && (!top || slot == 0) &&
+		    dentwrite(out, e) == -1) {
+			jobwarn("write");
+			break;
+		}
+		if (++seen % 1024 == 0)
+			jobsay('+', "%d", 1024);
+		if (c <= 0)
+			okl = walknext(&l, down);
+		if (c >= 0)
+			okr = walknext(&r, down);
+	}
+	if (r.dirfd != -1)
+		close(r.dirfd);
+	walkfree(&l);
+	walkfree(&r);
+}
+
+/* Read a record a worker sent whole into `ent', 0 when it is done */
+int
+diffread(int fd, struct entry *ent)
+{
+	struct dentrec rec;
+
+	ent->name = NULL;
+	if (readfull(fd, &rec, sizeof(rec)) == -1 || rec.len > PATH_MAX)
+		return 0;
+	ent->name = xmalloc(rec.len + 1);
+	if (readfull(fd, ent->name, rec.len) == -1) {
+		xfree(ent->name);
+		ent->name = NULL;
+		return 0;
+	}
+	ent->name[rec.len] = '\0';
+	ent->mode = rec.mode;
+	ent->mark = rec.mark;
+	ent->t = rec.t;
+	ent->tns = rec.tns;
+	ent->size = rec.size;
+	ent->dev = rec.dev;
+	ent->ino = rec.ino;
+	ent->uid = rec.uid;
+	ent->gid = rec.gid;
+	return 1;
+}
+
+/*
+ * Body of a compare job between `dirfd' and the directory `rdir' or
+ * the snapshot `snap', below the top level too if `deep' is set.  The
+ * sorted streams of the nworkers workers are merged into `dest', with
+ * entries only in `rdir' named by their full path so they open.
+ */
+int
+diffrun(int dirfd, char *rdir, char *snap, int deep, char *dest)
+{
+	struct entry *heads, ent;
+	pid_t *pids;
+	FILE *fp;
+	char *name;
+	int fd[2], *fds, i, k, out, status, r = 0;
+
+	out = open(dest, O_WRONLY | O_TRUNC);
+	if (out == -1)
+		return jobwarn(dest);
+	/* Fail once here rather than in every worker */
+	if (snap != NULL) {
+		fp = fopen(snap, "r");
+		if (fp == NULL) {
+			r = jobwarn(snap);
+		} else {
+			r = snaphead(fp, snap);
+			fclose(fp);
+		}
+		if (r == -1) {
+			close(out);
+			return r;
+		}
+	}
+	pids = xmalloc(nworkers * sizeof(*pids));
+	fds = xmalloc(nworkers * sizeof(*fds));
+	heads = xmalloc(nworkers * sizeof(*heads));
+	for (i = 0; i < nworkers; i++) {
+		fds[i] = pids[i] = -1;
+		heads[i].name = NULL;
+		if (pipe(fd) == -1) {
+			r = jobwarn("pipe");
+			continue;
+		}
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			close(fd[0]);
+			diffslot(dirfd, rdir, snap, deep, i, fd[1]);
+			_exit(0);
+		}
+		close(fd[1]);
+		if (pids[i] == -1) {
+			close(fd[0]);
+			r = jobwarn("fork");
+			continue;
+		}
+		fds[i] = fd[0];
+		diffread(fds[i], &heads[i]);
+	}
+
+	/* Each stream is in walk order, so is the merge */
+	for (;;) {
+		for (i = 0, k = -1; i < nworkers; i++)
+			if (heads[i].name != NULL && (k == -1 ||
+			    pathcmp(heads[i].name, heads[k].name) < 0))
+				k = i;
+		if (k == -1)
+			break;
+		ent = heads[k];
+		if (ent.mark == GONEMARK && snap == NULL) {
+			name = mkpath(rdir, ent.name);
+			xfree(ent.name);
+			ent.name = name;
+		}
+		if (r == 0 && dentwrite(out, &ent) == -1)
+			r = jobwarn(dest);
+		xfree(ent.name);
+		diffread(fds[k], &heads[k]);
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (fds[i] != -1)
+			close(fds[i]);
+		if (pids[i] > 0)
+			while (waitpid(pids[i], &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+	}
+	close(out);
+	xfree(heads);
+	xfree(fds);
+	xfree(pids);
+	return r;
+}
+
+/*
+ * Count the running jobs that were asked for, or with `internal' set
+ * those filling in the listing.  Each kind has maxjobs to itself.
+ */
+int
+jobcount(int internal)
+{
+	int i, k = 0;
+
+	for (i = 0; i < njobs; i++)
+		if (JOBINTERNAL(jobs[i].op) == internal)
+			k++;
+	return k;
+}
+
+/* Body of a job, runs in the child */
+int
+jobrun(enum jobop op, char *dir, char **names, int nnames, char *dest)
+{
+	struct stat sb;
+	char *ddir, *dname, *snap;
+	int sdirfd, ddirfd, i, r = 0;
+
+	sdirfd = pathopen(dir, O_RDONLY | O_DIRECTORY);
+	if (sdirfd == -1)
+		return jobwarn(dir);
+	if (op == JOB_HASH)
+		return hashrun(sdirfd, names, nnames);
+	if (op == JOB_LINKS)
+		return slotrun(sdirfd, names, nnames, dest, LINKBATCH,
+		    linkslot);
+	if (op == JOB_STAT)
+		return slotrun(sdirfd, names, nnames, dest, 2, statslot);
+	if (op == JOB_DUPS) {
+		ddirfd = open(dest, O_WRONLY | O_TRUNC);
+		if (ddirfd == -1)
+			return jobwarn(dest);
+		return dupsrun(sdirfd, ddirfd);
+	}
+	if (op == JOB_LARGEST || op == JOB_RECENT) {
+		rankbytime = op == JOB_RECENT;
+		return rankrun(sdirfd, dest);
+	}
+	/* Walks go in name order */
+	mtimeorder = 0;
+	if (op == JOB_SNAP)
+		return snaprun(sdirfd, dest);
+	if (op == JOB_DIFF || op == JOB_DIFFTREE) {
+		snap = stat(names[0], &sb) == 0 && S_ISDIR(sb.st_mode) ?
+		    NULL : names[0];
+		return diffrun(sdirfd, names[0], snap, op == JOB_DIFFTREE,
+		    dest);
+	}
+	if (op == JOB_DELETE) {
+		countrm = 1;
+		for (i = 0; i < nnames; i++) {
+			if (removepar(sdirfd, names[i]) == -1) {
+				r = -1;
+				continue;
+			}
+			rmcount(1);
+			/* Let the listing drop it right away */
+			jobsay('-', "%d", i);
+		}
+		return r;
+	}
+	/* Into an existing directory or to a new name */
+	if (stat(dest, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		ddir = dest;
+		dname = NULL;
+	} else {
+		ddir = xdirname(dest);
+		dname = basename(dest);
+	}
+	ddirfd = open(ddir, O_RDONLY | O_DIRECTORY);
+	if (ddirfd == -1)
+		return jobwarn(ddir);
+
+	for (i = 0; i < nnames; i++)
+		jobsay('=', "%llu", treesize(sdirfd, names[i]));
+	for (i = 0; i < nnames; i++) {
+		hastop = 0;
+		/* Names in views are paths */
+		if (op == JOB_COPY)
+			r |= copytree(sdirfd, names[i], ddirfd,
+			    dname != NULL ? dname : basename(names[i]));
+		else
+			r |= movetree(sdirfd, names[i], ddirfd,
+			    dname != NULL ? dname : basename(names[i]));
+	}
+	return r;
+}
+
+/*
+ * Start a job on `names' in `dir' in the background.  Return -1 if it
+ * could not start, `dest' is then still the caller's.
+ */
+int
+jobstart(enum jobop op, char *dir, char **names, int nnames, char *dest)
+{
+	static char *ops[] = { "copy", "move", "delete", "hash", "dups",
+	    "largest", "recent", "snapshot", "compare", "compare", "resolve",
+	    "stat" };
+	struct job *job;
+	struct stat sb;
+	char desc[LINE_MAX];
+	int fd[2], i;
+	pid_t pid;
+
+	if (jobcount(JOBINTERNAL(op)) >= maxjobs) {
+		printmsg("Too many jobs");
+		return -1;
+	}
+	if (pipe(fd) == -1) {
+		printwarn();
+		return -1;
+	}
+	pid = fork();
+	if (pid == -1) {
+		close(fd[0]);
+		close(fd[1]);
+		printwarn();
+		return -1;
+	}
+	if (pid == 0) {
+		/* Own process group so cancelling reaches the workers */
+		setpgid(0, 0);
+		/* Keep going if noice quits */
+		signal(SIGPIPE, SIG_IGN);
+		close(fd[0]);
+		jobfd = fd[1];
+		/* Not whatever the parent was doing when it forked */
+		MEMTAG(MEM_SPAWN);
+		_exit(jobrun(op, dir, names, nnames, dest) == 0 ? 0 : 1);
+	}
+	setpgid(pid, pid);
+	close(fd[1]);
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+	MEMTAG(MEM_SPAWN);
+	jobs = xrealloc(jobs, (njobs + 1) * sizeof(*jobs));
+	job = &jobs[njobs++];
+	memset(job, 0, sizeof(*job));
+	job->pid = pid;
+	job->fd = fd[0];
+	job->op = op;
+	job->dir = xstrdup(dir);
+	job->names = xmalloc(nnames * sizeof(*job->names));
+	for (i = 0; i < nnames; i++)
+		job->names[i] = xstrdup(names[i]);
+	job->nnames = nnames;
+	job->dest = dest != NULL ? xstrdup(dest) : NULL;
+	job->tab = tabs[curtab].id;
+	if (op == JOB_DUPS)
+		snprintf(desc, sizeof(desc), "find duplicates");
+	else if (op == JOB_LARGEST || op == JOB_RECENT)
+		snprintf(desc, sizeof(desc), "%s files", ops[op]);
+	else if (op == JOB_SNAP)
+		snprintf(desc, sizeof(desc), "snapshot %s", dir);
+	else if (op == JOB_LINKS)
+		snprintf(desc, sizeof(desc), "resolve %d links", nnames);
+	else if (op == JOB_STAT)
+		snprintf(desc, sizeof(desc), "stat %d late entries", nnames);
+	else if (op == JOB_DIFF || op == JOB_DIFFTREE)
+		snprintf(desc, sizeof(desc), "compare with %s",
+		    stat(names[0], &sb) == 0 && S_ISDIR(sb.st_mode) ?
+		    names[0] : "snapshot");
+	else if (nnames == 1)
+		snprintf(desc, sizeof(desc), "%s %s", ops[op], names[0]);
+	else
+		snprintf(desc, sizeof(desc), "%s %d files", ops[op], nnames);
+	job->desc = xstrdup(desc);
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	MEMTAG(MEM_LIST);
+	return 0;
+}
+
+/* Parse the progress records a job sent */
+void
+jobread(struct job *job)
+{
+	char buf[PIPE_BUF], *ln, *nl, *p;
+	ssize_t r;
+	size_t len, k;
+	int i;
+
+	while ((r = read(job->fd, buf, sizeof(buf))) > 0) {
+		p = buf;
+		/* The rest of a record too long to keep */
+		if (job->skip) {
+			nl = memchr(p, '\n', r);
+			if (nl == NULL)
+				continue;
+			r -= nl + 1 - p;
+			p = nl + 1;
+			job->skip = 0;
+		}
+		while (r > 0) {
+			k = MIN((size_t)r, sizeof(job->ln) - job->len);
+			memcpy(job->ln + job->len, p, k);
+			job->len += k;
+			p += k;
+			r -= k;
+			ln = job->ln;
+			len = job->len;
+			while ((nl = memchr(ln, '\n', len)) != NULL) {
+				*nl = '\0';
+				switch (ln[0]) {
+				case '=':
+					job->total += strtoull(ln + 1, NULL,
+					    10);
+					break;
+				case '+':
+					job->done += strtoull(ln + 1, NULL,
+					    10);
+					break;
+				case '-':
+					i = atoi(ln + 1);
+					if (i >= 0 && i < job->nnames)
+						dentdel(job->dir,
+						    job->names[i]);
+					break;
+				case '!':
+					strlcpy(job->err, ln + 1,
+					    sizeof(job->err));
+					break;
+				case '*':
+					job->fresh = 1;
+					break;
+				}
+				len -= nl + 1 - ln;
+				ln = nl + 1;
+			}
+			memmove(job->ln, ln, len);
+			job->len = len;
+			if (job->len < sizeof(job->ln))
+				continue;
+			/* Dropped, what it said is lost */
+			strlcpy(job->err, "progress record too long",
+			    sizeof(job->err));
+			job->len = 0;
+			nl = memchr(p, '\n', r);
+			if (nl == NULL) {
+				job->skip = 1;
+				break;
+			}
+			r -= nl + 1 - p;
+			p = nl + 1;
+		}
+	}
+}
+
+void
+jobfree(struct job *job)
+{
+	int i;
+
+	close(job->fd);
+	for (i = 0; i < job->nnames; i++)
+		xfree(job->names[i]);
+	xfree(job->names);
+	xfree(job->dir);
+	xfree(job->dest);
+	xfree(job->desc);
+}
+
+/* Take the records a links job appended since the last call */
+void
+linkload(struct job *job)
+{
+	struct linkrec rec;
+	char target[PATH_MAX + 1];
+	FILE *fp;
+
+	fp = fopen(job->dest, "r");
+	if (fp == NULL)
+		return;
+	fseeko(fp, job->off, SEEK_SET);
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		/* Leave a record still being written for next time */
+		if (rec.len < 0 || rec.len > PATH_MAX ||
+		    fread(target, 1, rec.len, fp) != (size_t)rec.len)
+			break;
+		target[rec.len] = '\0';
+		job->off = ftello(fp);
+		linkput(&rec, target);
+	}
+	fclose(fp);
+}
+
+/*
+ * Take the answers a stat job appended since the last call into the
+ * late entries of the listing it was started for, if it is still shown
+ */
+int
+statload(struct job *job)
+{
+	struct dentrec rec;
+	struct stat sb;
+	char name[NAME_MAX + 1], buf[NAME_MAX + 1];
+	FILE *fp;
+	int i, k = 0;
+
+	fp = fopen(job->dest, "r");
+	if (fp == NULL)
+		return 0;
+	fseeko(fp, job->off, SEEK_SET);
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		/* Leave a record still being written for next time */
+		if (rec.len > NAME_MAX ||
+		    fread(name, 1, rec.len, fp) != rec.len)
+			break;
+		name[rec.len] = '\0';
+		job->off = ftello(fp);
+		if (view != VIEW_DIR || spill != NULL ||
+		    strcmp(job->dir, path) != 0)
+			continue;
+		for (i = 0; i < n; i++)
+			if (dents[i].t == LATE &&
+			    strcmp(entname(pack, &dents[i], buf), name) == 0)
+				break;
+		if (i == n)
+			continue;
+		/* Failed again, the type readdir(3) gave will do */
+		if (rec.mode == 0) {
+			dents[i].t = 0;
+			continue;
+		}
+		memset(&sb, 0, sizeof(sb));
+		sb.st_mode = rec.mode;
+		sb.st_mtim.tv_sec = rec.t;
+		sb.st_mtim.tv_nsec = rec.tns;
+		sb.st_size = rec.size;
+		sb.st_dev = rec.dev;
+		sb.st_ino = rec.ino;
+		sb.st_uid = rec.uid;
+		sb.st_gid = rec.gid;
+		dentset(&dents[i], &sb);
+		k++;
+	}
+	fclose(fp);
+	if (k > 0)
+		gen = ++listgen;
+	return k;
+}
+
+/* Sort again by time once the late entries are in, keeping the cursor */
+void
+statsort(void)
+{
+	char *name;
+	int i;
+
+	if (!mtimeorder || pack != NULL || n == 0)
+		return;
+	listown();
+	name = xstrdup(dents[cur].name);
+	selsave();
+	qsort(dents, n, sizeof(*dents), entrycmp);
+	selload();
+	for (i = 0; i < n; i++)
+		if (strcmp(dents[i].name, name) == 0)
+			cur = i;
+	xfree(name);
+	gen = ++listgen;
+}
+
+/* Return 1 if a tab shows the view in `file' */
+int
+viewshown(char *file)
+{
+	int i;
+
+	if (viewfile != NULL && strcmp(viewfile, file) == 0)
+		return 1;
+	for (i = 0; i < ntabs; i++)
+		if (i != curtab && tabs[i].viewfile != NULL &&
+		    strcmp(tabs[i].viewfile, file) == 0)
+			return 1;
+	return 0;
+}
+
+/* Show the results of a rank job, return 1 if they are on screen */
+int
+rankshow(struct job *job)
+{
+	char *file;
+	int i;
+
+	if (!job->shown) {
+		job->shown = 1;
+		file = xstrdup(job->dest);
+		i = viewput(job, job->op == JOB_LARGEST ? VIEW_LARGEST :
+		    VIEW_RECENT, file);
+		if (i == -1)
+			xfree(file);
+		return i == curtab;
+	}
+	/* Once left the view stays closed */
+	return viewfile != NULL && strcmp(viewfile, job->dest) == 0;
+}
+
+/*
+ * Collect progress and finished jobs, return 1 if any finished or the
+ * view needs a refresh
+ */
+int
+jobpoll(void)
+{
+	struct job *job;
+	size_t len;
+	int i, k, status, done = 0, hashing = 0, restat = 0;
+
+	for (i = 0; i < njobs; i++) {
+		job = &jobs[i];
+		if (job->op == JOB_HASH)
+			hashing = 1;
+		jobread(job);
+		/* Show link targets and late entries as they come in */
+		if (job->op == JOB_LINKS)
+			linkload(job);
+		if (job->op == JOB_STAT)
+			statload(job);
+		if (job->fresh) {
+			job->fresh = 0;
+			if (rankshow(job)) {
+				snprintf(jobmsg, sizeof(jobmsg), "%s: %llu seen",
+				    job->desc, job->done);
+				done = 1;
+			}
+		}
+		if (waitpid(job->pid, &status, WNOHANG) != job->pid)
+			continue;
+		/* Drain what was written before exiting */
+		jobread(job);
+		/* The targets are in the listing, nothing to refresh */
+		if (job->op == JOB_LINKS) {
+			linkload(job);
+			unlink(job->dest);
+		} else if (job->op == JOB_STAT) {
+			if (statload(job) > 0 && strcmp(job->dir, path) == 0)
+				statsort();
+			unlink(job->dest);
+			/* Rescanned meanwhile, others may have run late */
+			restat = !WIFSIGNALED(status);
+		} else if (WIFSIGNALED(status))
+			snprintf(jobmsg, sizeof(jobmsg), "%s: cancelled",
+			    job->desc);
+		else if (job->err[0] != '\0')
+			/* Errors name paths, keep room for the job */
+			snprintf(jobmsg, sizeof(jobmsg), "%s: %.*s", job->desc,
+			    (int)sizeof(jobmsg) / 2, job->err);
+		else
+			snprintf(jobmsg, sizeof(jobmsg), "%s: done",
+			    job->desc);
+		/* Results replace the listing, the file belongs to it now */
+		if (job->op == JOB_DUPS || job->op == JOB_DIFF ||
+		    job->op == JOB_DIFFTREE) {
+			k = -1;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				k = viewput(job, job->op == JOB_DUPS ?
+				    VIEW_DUPS : VIEW_DIFF, job->dest);
+			if (k == -1) {
+				unlink(job->dest);
+				xfree(job->dest);
+			} else if (k != curtab) {
+				len = strlen(jobmsg);
+				snprintf(jobmsg + len, sizeof(jobmsg) - len,
+				    ", see tab %d", k + 1);
+			}
+			job->dest = NULL;
+		}
+		if (job->op == JOB_LARGEST || job->op == JOB_RECENT) {
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				rankshow(job);
+			if (!viewshown(job->dest))
+				unlink(job->dest);
+		}
+		jobfree(job);
+		done |= !JOBINTERNAL(job->op);
+		memmove(job, job + 1, (njobs - i - 1) * sizeof(*job));
+		njobs--;
+		i--;
+	}
+	/* Show checksums as they come in */
+	if (hashing)
+		cksumload();
+	/* What the stat job found may be links to read */
+	if (restat) {
+		statstart();
+		linkstart();
+	}
+	return done;
+}
+
+/* Print one line per running job above the message line */
+void
+printjobs(void)
+{
+	struct job *job;
+	char *rate;
+	long us;
+	int i, pct;
+
+	for (i = 0; i < njobs; i++) {
+		job = &jobs[i];
+		if (job->op == JOB_DELETE) {
+			mvprintw(LINES - 1 - njobs + i, 0,
+			    "[%d] %llu removed %.*s", (int)job->pid,
+			    job->done, COLS / 2, job->desc);
+			continue;
+		}
+		if (job->op == JOB_LARGEST || job->op == JOB_RECENT ||
+		    job->op == JOB_SNAP || job->op == JOB_DIFF ||
+		    job->op == JOB_DIFFTREE || JOBINTERNAL(job->op)) {
+			mvprintw(LINES - 1 - njobs + i, 0,
+			    "[%d] %llu seen %.*s", (int)job->pid,
+			    job->done, COLS / 2, job->desc);
+			continue;
+		}
+		us = usecsince(&job->start);
+		pct = job->total > 0 ? job->done * 100 / job->total : 0;
+		rate = printsize(us > 0 ? job->done * 1000000.0 / us : 0);
+		mvprintw(LINES - 1 - njobs + i, 0, "[%d] %3d%% %s/s %.*s",
+		    (int)job->pid, pct, rate + strspn(rate, " "),
+		    COLS / 2, job->desc);
+		xfree(rate);
+	}
+}
+
+/* Drop `name' from the listing if `dir' is on display */
+void
+dentdel(char *dir, char *name)
+{
+	int i;
+
+	/* A spilled listing is read again when the job is done */
+	if (strcmp(dir, path) != 0 || spill != NULL)
+		return;
+	if (pack != NULL) {
+		i = packfind(pack, dents, n, name);
+		if (i == -1)
+			return;
+	} else {
+		for (i = 0; i < n; i++)
+			if (strcmp(dents[i].name, name) == 0)
+				break;
+		if (i == n)
+			return;
+	}
+	/* Other tabs showing the listing keep it as it was */
+	listown();
+	if (pack == NULL)
+		xfree(dents[i].name);
+	selanchor = -1;
+	if ((filemode(dents[i].mode) == 0 || filemode(dents[i].mode) == '*') &&
+	    dents[i].size != NOSIZE)
+		totalsize -= dents[i].size;
+	memmove(&dents[i], &dents[i + 1], (n - i - 1) * sizeof(*dents));
+	if (ISSEL(i))
+		nsel--;
+	for (; i < n - 1; i++)
+		if (ISSEL(i + 1))
+			SELSET(i);
+		else
+			SELCLR(i);
+	n--;
+	if (cur > i || cur == n)
+		cur = cur > 0 ? cur - 1 : 0;
+	gen = ++listgen;
+}
+
+void
+selclear(void)
+{
+	int i;
+
+	if (selbits != NULL)
+		memset(selbits, 0, (n + 7) / 8);
+	nsel = 0;
+	for (i = 0; i < nselkeep; i++)
+		xfree(selkeep[i]);
+	xfree(selkeep);
+	selkeep = NULL;
+	nselkeep = 0;
+	selanchor = -1;
+}
+
+/* Keep the names of selected entries across a rescan */
+void
+selsave(void)
+{
+	int i;
+
+	if (nsel == 0)
+		return;
+	selkeep = xrealloc(selkeep, (nselkeep + nsel) * sizeof(*selkeep));
+	for (i = 0; i < n; i++) {
+		if (!ISSEL(i))
+			continue;
+		if (pack != NULL) {
+			selkeep[nselkeep++] = xstrdup(packname(pack,
+			    dents[i].id));
+		} else if (spill != NULL) {
+			selkeep[nselkeep++] = xstrdup(dentat(spill, dents,
+			    i)->name);
+		} else {
+			/* Other tabs may show the listing still */
+			selkeep[nselkeep++] = xstrdup(dents[i].name);
+		}
+	}
+	nsel = 0;
+}
+
+int
+namecmp(const void *va, const void *vb)
+{
+	return strcmp(*(char **)va, *(char **)vb);
+}
+
+/*
+ * Select the entries of a new listing whose names were kept.  Names
+ * the filter now hides or that are gone are dropped, so the selection
+ * is always what is shown and counted.
+ */
+void
+selload(void)
+{
+	char *name, buf[NAME_MAX + 1];
+	int i;
+
+	selbits = xrealloc(selbits, (n + 7) / 8 + 1);
+	memset(selbits, 0, (n + 7) / 8 + 1);
+	selanchor = -1;
+	if (nselkeep == 0)
+		return;
+
+	qsort(selkeep, nselkeep, sizeof(*selkeep), namecmp);
+	for (i = 0; i < n; i++) {
+		name = entname(pack, dentat(spill, dents, i), buf);
+		if (bsearch(&name, selkeep, nselkeep, sizeof(*selkeep),
+		    namecmp) == NULL)
+			continue;
+		SELSET(i);
+		nsel++;
+	}
+	for (i = 0; i < nselkeep; i++)
+		xfree(selkeep[i]);
+	xfree(selkeep);
+	selkeep = NULL;
+	nselkeep = 0;
+}
+
+/*
+ * Return the selected names, or the current one if nothing is selected.
+ * Front-coded names are copied behind the array, in the same allocation.
+ */
+int
+selnames(char ***names)
+{
+	size_t len = 0;
+	char *p;
+	int i, k = 0;
+
+	if (pack != NULL)
+		for (i = 0; i < n; i++)
+			if (ISSEL(i) || (nsel == 0 && i == cur))
+				len += strlen(packname(pack, dents[i].id)) + 1;
+	*names = xmalloc(MAX(nsel, 1) * sizeof(**names) + len);
+	p = (char *)(*names + MAX(nsel, 1));
+	for (i = 0; i < n; i++) {
+		if (!ISSEL(i) && (nsel != 0 || i != cur))
+			continue;
+		if (pack != NULL) {
+			(*names)[k++] = strcpy(p, packname(pack, dents[i].id));
+			p += strlen(p) + 1;
+		} else
+			(*names)[k++] = dentat(spill, dents, i)->name;
+	}
+	return k;
+}
+
+/* Append `ent' to a view file */
+int
+dentwrite(int fd, struct entry *ent)
+{
+	struct dentrec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.mode = ent->mode;
+	rec.mark = ent->mark;
+	rec.t = ent->t;
+	rec.tns = ent->tns;
+	rec.size = ent->size;
+	rec.dev = ent->dev;
+	rec.ino = ent->ino;
+	rec.uid = ent->uid;
+	rec.gid = ent->gid;
+	rec.len = strlen(ent->name);
+	if (write(fd, &rec, sizeof(rec)) != sizeof(rec) ||
+	    write(fd, ent->name, rec.len) != (ssize_t)rec.len)
+		return -1;
+	return 0;
+}
+
+/*
+ * Fill the listing from a view file.  Names are paths relative to
+ * `path'; entries that are gone are skipped unless marked, and the
+ * others refreshed so the view stays accurate after jobs changed the
+ * tree.
+ */
+int
+viewfill(char *path, char *file, struct entry **dents,
+	 int (*filter)(regex_t *, char *), regex_t *re)
+{
+	struct dentrec rec;
+	struct stat sb;
+	unsigned int mask;
+	char *name;
+	FILE *fp;
+	int dirfd, cached, n = 0;
+
+	totalsize = 0;
+	namebytes = 0;
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return 0;
+	mask = statmask();
+	cached = mountcached(path);
+	dirfd = pathopen(path, O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1) {
+		fclose(fp);
+		return 0;
+	}
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		name = xmalloc(rec.len + 1);
+		if (fread(name, 1, rec.len, fp) != rec.len) {
+			xfree(name);
+			break;
+		}
+		name[rec.len] = '\0';
+		if (filter(re, name) == 0) {
+			xfree(name);
+			continue;
+		}
+		/* A marked entry may be gone on purpose, as it was */
+		if (dentstat(dirfd, name, &sb, mask, cached) == -1) {
+			if (rec.mark == 0) {
+				xfree(name);
+				continue;
+			}
+			sb.st_mode = rec.mode;
+			sb.st_mtim.tv_sec = rec.t;
+			sb.st_mtim.tv_nsec = rec.tns;
+			sb.st_size = rec.size;
+			sb.st_dev = rec.dev;
+			sb.st_ino = rec.ino;
+			sb.st_uid = rec.uid;
+			sb.st_gid = rec.gid;
+		}
+		*dents = xrealloc(*dents, (n + 1) * sizeof(**dents));
+		(*dents)[n].name = name;
+		namebytes += rec.len + 1;
+		(*dents)[n].mode = sb.st_mode;
+		(*dents)[n].t = sb.st_mtime;
+		(*dents)[n].tns = sb.st_mtim.tv_nsec;
+		(*dents)[n].size = sb.st_size;
+		(*dents)[n].dev = sb.st_dev;
+		(*dents)[n].ino = sb.st_ino;
+		(*dents)[n].uid = sb.st_uid;
+		(*dents)[n].gid = sb.st_gid;
+		(*dents)[n].mark = rec.mark;
+		if (filemode(sb.st_mode) == 0 || filemode(sb.st_mode) == '*')
+			totalsize += sb.st_size;
+		n++;
+	}
+	close(dirfd);
+	fclose(fp);
+	return n;
+}
+
+/* Return a new empty file for the results of a view */
+char *
+viewtemp(void)
+{
+	char *file;
+	int fd;
+
+	file = mkpath(xgetenv("TMPDIR", "/tmp"), "noice.XXXXXXXXXX");
+	fd = mkstemp(file);
+	if (fd == -1) {
+		xfree(file);
+		return NULL;
+	}
+	close(fd);
+	return file;
+}
+
+/* Show the results in `file' of a view rooted at `dir' */
+void
+viewopen(int v, char *dir, char *file)
+{
+	viewclose();
+	view = v;
+	viewfile = file;
+	pathset(xstrdup(dir));
+	xfree(oldpath);
+	oldpath = NULL;
+	/* Duplicates are told apart by checksum */
+	if (v == VIEW_DUPS)
+		showhash = 1;
+}
+
+/* Back to the plain listing */
+void
+viewclose(void)
+{
+	if (viewfile != NULL) {
+		unlink(viewfile);
+		xfree(viewfile);
+		viewfile = NULL;
+	}
+	/* The index stays cached while it is in arcs[] */
+	arcput(arc);
+	arc = NULL;
+	xfree(arcpath);
+	arcpath = NULL;
+	view = VIEW_DIR;
+}
+
+/* Mirror the listing of the current tab into `list' and its tabs */
+void
+listsync(void)
+{
+	struct tab *t;
+	int i;
+
+	if (list == NULL)
+		return;
+	list->dents = dents;
+	list->pack = pack;
+	list->spill = spill;
+	list->n = n;
+	list->totalsize = totalsize;
+	list->namebytes = namebytes;
+	list->gen = gen;
+	for (i = 0; i < ntabs; i++) {
+		t = &tabs[i];
+		if (t->list != list)
+			continue;
+		t->dents = dents;
+		t->pack = pack;
+		t->spill = spill;
+		t->n = n;
+		t->totalsize = totalsize;
+		t->gen = gen;
+	}
+}
+
+/* Let go of `l', it is freed with the last tab showing it */
+void
+listput(struct listing *l)
+{
+	if (l == NULL || --l->refs > 0)
+		return;
+	listfree(l->dents, l->n, l->pack, l->spill);
+	xfree(l->path);
+	xfree(l->fltr);
+	xfree(l);
+}
+
+/*
+ * Return the listing another tab has of the current directory, read
+ * with the same filter and order, if the directory in `sb' is still as
+ * it was then, or NULL.  Changes to the files in it leave the mtime of
+ * the directory alone, so listings older than LISTTTL are read again.
+ */
+struct listing *
+listfind(struct stat *sb)
+{
+	struct listing *l;
+	int i;
+
+	for (i = 0; i < ntabs; i++) {
+		l = tabs[i].list;
+		if (i == curtab || l == NULL || l->path == NULL)
+			continue;
+		if (strcmp(l->path, path) == 0 && strcmp(l->fltr, fltr) == 0 &&
+		    l->mtimeorder == mtimeorder && (l->owner || !showowner) &&
+		    l->dev == sb->st_dev && l->ino == sb->st_ino &&
+		    l->mtim.tv_sec == sb->st_mtim.tv_sec &&
+		    l->mtim.tv_nsec == sb->st_mtim.tv_nsec &&
+		    usecsince(&l->scanned) < LISTTTL * 1000000L)
+			return l;
+	}
+	return NULL;
+}
+
+/*
+ * Give the current tab a copy of its listing before it is changed in
+ * place, the other tabs keep theirs as it was
+ */
+void
+listown(void)
+{
+	struct listing *l;
+	struct entry *cp;
+	int i;
+
+	/* Spilled listings are not changed in place */
+	if (list == NULL || list->refs == 1 || spill != NULL)
+		return;
+	listsync();
+	list->refs--;
+	l = xmalloc(sizeof(*l));
+	*l = *list;
+	l->refs = 1;
+	l->path = NULL;
+	l->fltr = NULL;
+	cp = xmalloc((n + 1) * sizeof(*cp));
+	memcpy(cp, dents, n * sizeof(*cp));
+	if (pack != NULL)
+		pack = packcopy(pack);
+	else
+		for (i = 0; i < n; i++)
+			cp[i].name = xstrdup(dents[i].name);
+	dents = cp;
+	list = l;
+	listsync();
+}
+
+/* Keep the listing state of the current tab in tabs[i] */
+void
+tabsave(int i)
+{
+	struct tab *t = &tabs[i];
+
+	t->list = list;
+	listsync();
+	t->path = path;
+	t->pathcap = pathcap;
+	t->fltr = fltr;
+	t->dents = dents;
+	t->pack = pack;
+	t->spill = spill;
+	t->n = n;
+	t->cur = cur;
+	t->view = view;
+	t->viewfile = viewfile;
+	t->arc = arc;
+	t->arcpath = arcpath;
+	t->totalsize = totalsize;
+	t->selbits = selbits;
+	t->nsel = nsel;
+	t->selkeep = selkeep;
+	t->nselkeep = nselkeep;
+	t->selpath = selpath;
+	t->selview = selview;
+	t->selanchor = selanchor;
+	t->mtimeorder = mtimeorder;
+	t->gen = gen;
+	t->visitpath = visitpath;
+	t->visitfltr = visitfltr;
+}
+
+/* Make tabs[i] the current tab, as it was left */
+void
+tabload(int i)
+{
+	struct tab *t = &tabs[i];
+
+	path = t->path;
+	pathcap = t->pathcap;
+	fltr = t->fltr;
+	list = t->list;
+	if (list != NULL)
+		namebytes = list->namebytes;
+	dents = t->dents;
+	pack = t->pack;
+	spill = t->spill;
+	n = t->n;
+	cur = t->cur;
+	view = t->view;
+	viewfile = t->viewfile;
+	arc = t->arc;
+	arcpath = t->arcpath;
+	totalsize = t->totalsize;
+	selbits = t->selbits;
+	nsel = t->nsel;
+	selkeep = t->selkeep;
+	nselkeep = t->nselkeep;
+	selpath = t->selpath;
+	selview = t->selview;
+	selanchor = t->selanchor;
+	mtimeorder = t->mtimeorder;
+	gen = t->gen;
+	visitpath = t->visitpath;
+	visitfltr = t->visitfltr;
+}
+
+/* Start a new current tab on `dir', the old state is in tabs[] */
+void
+tabnew(char *dir, const char *filter)
+{
+	path = dir;
+	pathcap = strlen(dir) + 1;
+	fltr = xstrdup(filter);
+	list = NULL;
+	dents = NULL;
+	pack = NULL;
+	spill = NULL;
+	n = cur = 0;
+	view = VIEW_DIR;
+	viewfile = NULL;
+	arc = NULL;
+	arcpath = NULL;
+	totalsize = 0;
+	selbits = NULL;
+	nsel = 0;
+	selkeep = NULL;
+	nselkeep = 0;
+	selpath = NULL;
+	selanchor = -1;
+	gen = 0;
+	visitpath = NULL;
+	visitfltr = NULL;
+	memset(&tabs[ntabs], 0, sizeof(tabs[ntabs]));
+	tabs[ntabs].id = ++tabids;
+	curtab = ntabs++;
+}
+
+/*
+ * Open the view in `file' for `job' in the tab that started it, or in a
+ * new one if that tab was closed or has moved on since, leaving the
+ * current tab as it is.  Return the tab or -1 if none was free, the
+ * file is then still the caller's.
+ */
+int
+viewput(struct job *job, int v, char *file)
+{
+	char *keep;
+	int i, old = curtab;
+
+	tabsave(curtab);
+	for (i = 0; i < ntabs; i++)
+		if (tabs[i].id == job->tab)
+			break;
+	/* A tab that moved on keeps what it shows */
+	if (i < ntabs && (tabs[i].view != VIEW_DIR ||
+	    strcmp(tabs[i].path, job->dir) != 0))
+		i = ntabs;
+	if (i == ntabs && ntabs == MAXTABS)
+		return -1;
+	keep = oldpath;
+	oldpath = NULL;
+	if (i == ntabs) {
+		tabnew(xstrdup(job->dir), fltr);
+		i = curtab;
+	} else {
+		tabload(i);
+	}
+	viewopen(v, job->dir, file);
+	tabsave(i);
+	tabs[i].stale = i != old;
+	curtab = old;
+	tabload(curtab);
+	oldpath = keep;
+	return i;
+}
+
+void
+tabfree(struct tab *t)
+{
+	int i;
+
+	if (t->visitpath != NULL) {
+		visitsave(t->visitpath, t->dents, t->n, t->pack,
+		    t->visitfltr);
+		xfree(t->visitpath);
+		xfree(t->visitfltr);
+	}
+	listput(t->list);
+	xfree(t->path);
+	xfree(t->fltr);
+	xfree(t->selbits);
+	for (i = 0; i < t->nselkeep; i++)
+		xfree(t->selkeep[i]);
+	xfree(t->selkeep);
+	xfree(t->selpath);
+	if (t->viewfile != NULL) {
+		unlink(t->viewfile);
+		xfree(t->viewfile);
+	}
+	arcput(t->arc);
+	xfree(t->arcpath);
+}
+
+/* Return the bytes taken by all but one file of each duplicate group */
+unsigned long
+dupsize(void)
+{
+	unsigned long long a, b;
+	unsigned long size = 0;
+	int i;
+
+	cksumload();
+	for (i = 1; i < n; i++)
+		if (dents[i].size == dents[i - 1].size &&
+		    cksumget(dents[i].dev, dents[i].ino, dents[i].size,
+		    dents[i].t, &a) &&
+		    cksumget(dents[i - 1].dev, dents[i - 1].ino,
+		    dents[i - 1].size, dents[i - 1].t, &b) && a == b)
+			size += dents[i].size;
+	return size;
+}
+
+/*
+ * Archives are entered like directories.  Their members are indexed
+ * once by reading only the headers, sequentially for tar and from the
+ * central directory for zip, and the index is cached by device, inode
+ * and mtime.  Members are extracted when opened.
+ */
+
+/* Parse a tar number, octal or base-256 for large values */
+unsigned long long
+tarnum(const unsigned char *p, int len)
+{
+	unsigned long long v = 0;
+	int i;
+
+	if (p[0] & 0x80) {
+		v = p[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			v = v << 8 | p[i];
+		return v;
+	}
+	for (i = 0; i < len && (p[i] == ' ' || p[i] == '0'); i++)
+		;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		v = v << 3 | (p[i] - '0');
+	return v;
+}
+
+int
+tarsumok(const unsigned char *h)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < 512; i++)
+		sum += i >= 148 && i < 156 ? ' ' : h[i];
+	return sum == tarnum(h + 148, 8);
+}
+
+/* Read `len' bytes at `off' into a new string */
+char *
+preadstr(int fd, off_t off, size_t len)
+{
+	char *s;
+
+	s = xmalloc(len + 1);
+	if (pread(fd, s, len, off) != (ssize_t)len) {
+		xfree(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+/*
+ * Return the path in pax header `pax' of `len' bytes, or NULL.  Records
+ * are "len key=value\n" with len counting the whole record, a value
+ * is cut short in place.
+ */
+char *
+paxpath(char *pax, size_t len)
+{
+	char *p = pax, *q, *end = pax + len;
+	unsigned long n;
+
+	while (p < end) {
+		n = strtoul(p, &q, 10);
+		if (q == p || *q != ' ' || n == 0 || n > (size_t)(end - p) ||
+		    p[n - 1] != '\n')
+			return NULL;
+		q++;
+		if (p + n - q > 5 && strncmp(q, "path=", 5) == 0) {
+			p[n - 1] = '\0';
+			return xstrdup(q + 5);
+		}
+		p += n;
+	}
+	return NULL;
+}
+
+void
+arcadd(struct archive *a, char *path, mode_t mode, time_t t,
+       unsigned long long size, off_t off, unsigned long long csize,
+       int method)
+{
+	struct member *m;
+	char *p;
+	size_t len;
+
+	/* Store paths relative to the archive root without slashes around */
+	while (path[0] == '/' || (path[0] == '.' && path[1] == '/'))
+		path += path[0] == '/' ? 1 : 2;
+	len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	if (len == 0)
+		return;
+
+	a->m = xrealloc(a->m, (a->n + 1) * sizeof(*a->m));
+	m = &a->m[a->n++];
+	m->path = xmalloc(len + 1);
+	memcpy(m->path, path, len);
+	m->path[len] = '\0';
+	p = strrchr(m->path, '/');
+	m->name = p != NULL ? p + 1 : m->path;
+	m->mode = mode;
+	m->t = t;
+	m->size = size;
+	m->off = off;
+	m->csize = csize;
+	m->method = method;
+}
+
+int
+tarindex(int fd, struct archive *a)
+{
+	unsigned char h[512];
+	unsigned long long size;
+	char *name, *longname = NULL, *pax;
+	off_t off = 0, data;
+	mode_t mode;
+
+	while (pread(fd, h, sizeof(h), off) == sizeof(h)) {
+		/* A zero block ends the archive */
+		if (h[0] == '\0')
+			break;
+		if (!tarsumok(h)) {
+			xfree(longname);
+			return -1;
+		}
+		size = tarnum(h + 124, 12);
+		data = off + 512;
+		off = data + (size + 511) / 512 * 512;
+
+		switch (h[156]) {
+		case 'L':
+			/* GNU long name in the data, sizes come from the file */
+			if (size > PATH_MAX)
+				continue;
+			xfree(longname);
+			longname = preadstr(fd, data, size);
+			continue;
+		case 'x':
+			/* pax extended header, only the path matters */
+			if (size > PAXMAX)
+				continue;
+			pax = preadstr(fd, data, size);
+			if (pax == NULL)
+				continue;
+			name = paxpath(pax, size);
+			if (name != NULL) {
+				xfree(longname);
+				longname = name;
+			}
+			xfree(pax);
+			continue;
+		case 'g':
+		case 'K':
+			/* Global pax headers and GNU long link names */
+			continue;
+		}
+
+		if (longname != NULL) {
+			name = longname;
+		} else {
+			/* ustar splits long names in prefix and name */
+			name = xmalloc(155 + 1 + 100 + 1);
+			if (h[345] != '\0')
+				sprintf(name, "%.155s/%.100s", (char *)h + 345,
+				    (char *)h);
+			else
+				sprintf(name, "%.100s", (char *)h);
+		}
+		mode = tarnum(h + 100, 8) & ~S_IFMT;
+		switch (h[156]) {
+		case '5':
+			mode |= S_IFDIR;
+			break;
+		case '2':
+			mode |= S_IFLNK;
+			break;
+		case '3':
+		case '4':
+		case '6':
+			/* Devices and fifos cannot be opened from here */
+			mode |= S_IFIFO;
+			break;
+		default:
+			mode |= S_IFREG;
+		}
+		arcadd(a, name, mode, tarnum(h + 136, 12),
+		    S_ISREG(mode) ? size : 0, data, size, 0);
+		xfree(name);
+		longname = NULL;
+	}
+	xfree(longname);
+	return 0;
+}
+
+unsigned long
+le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+unsigned long
+le32(const unsigned char *p)
+{
+	return le16(p) | le16(p + 2) << 16;
+}
+
+unsigned long long
+le64(const unsigned char *p)
+{
+	return le32(p) | (unsigned long long)le32(p + 4) << 32;
+}
+
+time_t
+dostime(unsigned long date, unsigned long time)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = (date >> 9) + 80;
+	tm.tm_mon = ((date >> 5) & 0xf) - 1;
+	tm.tm_mday = date & 0x1f;
+	tm.tm_hour = time >> 11;
+	tm.tm_min = (time >> 5) & 0x3f;
+	tm.tm_sec = (time & 0x1f) * 2;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+int
+zipindex(int fd, struct archive *a, off_t fsize)
+{
+	unsigned char buf[65536 + 22], *p, *e, h[56];
+	unsigned long long count, cdoff, usize, csize, off, i;
+	unsigned long nlen, elen, clen, id, len;
+	char *name, *extra;
+	size_t tail;
+	mode_t mode;
+	FILE *fp;
+	int dfd;
+
+	/* The end of central directory record is near the end */
+	tail = MIN(fsize, (off_t)sizeof(buf));
+	if (pread(fd, buf, tail, fsize - tail) != (ssize_t)tail)
+		return -1;
+	for (p = buf + tail - 22; p >= buf; p--)
+		if (le32(p) == 0x06054b50)
+			break;
+	if (p < buf)
+		return -1;
+	count = le16(p + 10);
+	cdoff = le32(p + 16);
+	/* Zip64 keeps the real values in a record of its own */
+	if ((cdoff == 0xffffffff || count == 0xffff) && p - buf >= 20 &&
+	    le32(p - 20) == 0x07064b50) {
+		if (pread(fd, h, 56, le64(p - 20 + 8)) != 56 ||
+		    le32(h) != 0x06064b50)
+			return -1;
+		count = le64(h + 32);
+		cdoff = le64(h + 48);
+	}
+
+	dfd = dup(fd);
+	if (dfd == -1)
+		return -1;
+	fp = fdopen(dfd, "r");
+	if (fp == NULL) {
+		close(dfd);
+		return -1;
+	}
+	if (fseeko(fp, cdoff, SEEK_SET) == -1) {
+		fclose(fp);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (fread(h, 46, 1, fp) != 1 || le32(h) != 0x02014b50)
+			break;
+		nlen = le16(h + 28);
+		elen = le16(h + 30);
+		clen = le16(h + 32);
+		csize = le32(h + 20);
+		usize = le32(h + 24);
+		off = le32(h + 42);
+		name = xmalloc(nlen + 1);
+		extra = xmalloc(elen + 1);
+		if (fread(name, 1, nlen, fp) != nlen ||
+		    fread(extra, 1, elen, fp) != elen ||
+		    fseeko(fp, clen, SEEK_CUR) == -1) {
+			xfree(name);
+			xfree(extra);
+			break;
+		}
+		name[nlen] = '\0';
+		/* Zip64 extra field has the values that did not fit */
+		for (p = (unsigned char *)extra, e = p + elen; e - p >= 4;
+		     p += 4 + len) {
+			id = le16(p);
+			len = le16(p + 2);
+			if (id != 0x0001)
+				continue;
+			e = p + 4 + MIN(len, (unsigned long)(e - p - 4));
+			p += 4;
+			if (usize == 0xffffffff && e - p >= 8) {
+				usize = le64(p);
+				p += 8;
+			}
+			if (csize == 0xffffffff && e - p >= 8) {
+				csize = le64(p);
+				p += 8;
+			}
+			if (off == 0xffffffff && e - p >= 8)
+				off = le64(p);
+			break;
+		}
+		/* Unix permissions if made on Unix */
+		mode = le16(h + 4) >> 8 == 3 ? le32(h + 38) >> 16 : 0;
+		if (nlen > 0 && name[nlen - 1] == '/')
+			mode = S_IFDIR | (mode & ~S_IFMT ? mode & ~S_IFMT : 0755);
+		else if ((mode & S_IFMT) == 0)
+			mode = S_IFREG | (mode ? mode : 0644);
+		arcadd(a, name, mode, dostime(le16(h + 14), le16(h + 12)),
+		    S_ISREG(mode) ? usize : 0, off, csize, le16(h + 10));
+		xfree(name);
+		xfree(extra);
+	}
+	fclose(fp);
+	return 0;
+}
+
+int
+membercmp(const void *va, const void *vb)
+{
+	return strcmp(((struct member *)va)->path,
+	    ((struct member *)vb)->path);
+}
+
+/* Add the directories that are only implied by member paths */
+void
+arcdirs(struct archive *a)
+{
+	struct member key;
+	char *p;
+	int i, n;
+
+	qsort(a->m, a->n, sizeof(*a->m), membercmp);
+	n = a->n;
+	for (i = 0; i < n; i++) {
+		key.path = xstrdup(a->m[i].path);
+		while ((p = strrchr(key.path, '/')) != NULL) {
+			*p = '\0';
+			if (bsearch(&key, a->m, n, sizeof(*a->m), membercmp))
+				break;
+			/* Sorted order puts the deepest first, skip repeats */
+			if (a->n > n && strcmp(a->m[a->n - 1].path,
+			    key.path) == 0)
+				break;
+			arcadd(a, key.path, S_IFDIR | 0755, a->m[i].t, 0, 0, 0,
+			    0);
+		}
+		xfree(key.path);
+	}
+	qsort(a->m, a->n, sizeof(*a->m), membercmp);
+	/* Names point into paths that moved along with the members */
+	for (i = 0; i < a->n; i++) {
+		p = strrchr(a->m[i].path, '/');
+		a->m[i].name = p != NULL ? p + 1 : a->m[i].path;
+	}
+	/* The same directory may still be added from different subtrees */
+	for (i = n = 0; i < a->n; i++) {
+		if (n > 0 && strcmp(a->m[n - 1].path, a->m[i].path) == 0 &&
+		    S_ISDIR(a->m[i].mode)) {
+			xfree(a->m[i].path);
+			continue;
+		}
+		a->m[n++] = a->m[i];
+	}
+	a->n = n;
+}
+
+void
+arcfree(struct archive *a)
+{
+	int i;
+
+	if (a == NULL)
+		return;
+	for (i = 0; i < a->n; i++)
+		xfree(a->m[i].path);
+	xfree(a->m);
+	xfree(a);
+}
+
+/* Let go of `a', it is freed when no tab browses it and it left arcs[] */
+void
+arcput(struct archive *a)
+{
+	if (a != NULL && --a->refs == 0)
+		arcfree(a);
+}
+
+/*
+ * Return the index of `file' if it is an archive, NULL otherwise.  The
+ * caller holds a reference to it until arcput().
+ */
+struct archive *
+arcget(char *file, struct stat *sb)
+{
+	unsigned char h[512];
+	struct archive *a;
+	int fd, i, r = -1;
+
+	for (i = 0; i < ARCCACHE; i++) {
+		a = arcs[i];
+		if (a != NULL && a->dev == sb->st_dev &&
+		    a->ino == sb->st_ino && a->t == sb->st_mtime) {
+			memmove(&arcs[1], &arcs[0], i * sizeof(*arcs));
+			arcs[0] = a;
+			a->refs++;
+			return a;
+		}
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (pread(fd, h, sizeof(h), 0) < 4) {
+		close(fd);
+		return NULL;
+	}
+	a = xmalloc(sizeof(*a));
+	memset(a, 0, sizeof(*a));
+	a->dev = sb->st_dev;
+	a->ino = sb->st_ino;
+	a->t = sb->st_mtime;
+	if (memcmp(h, "PK\3\4", 4) == 0 || memcmp(h, "PK\5\6", 4) == 0) {
+		a->type = ARC_ZIP;
+		r = zipindex(fd, a, sb->st_size);
+	} else if (sb->st_size >= 512 && memcmp(h + 257, "ustar", 5) == 0) {
+		a->type = ARC_TAR;
+		r = tarindex(fd, a);
+	}
+	close(fd);
+	if (r == -1) {
+		arcfree(a);
+		return NULL;
+	}
+	arcdirs(a);
+
+	/* Most recent first, tabs keep what falls out until they leave */
+	arcput(arcs[ARCCACHE - 1]);
+	memmove(&arcs[1], &arcs[0], (ARCCACHE - 1) * sizeof(*arcs));
+	arcs[0] = a;
+	a->refs = 2;
+	return a;
+}
+
+/* Return the path inside the archive of the current directory */
+char *
+arcdir(void)
+{
+	char *p;
+
+	p = path + strlen(arcpath);
+	return *p == '/' ? p + 1 : p;
+}
+
+/* Fill the listing with the members in the current archive directory */
+int
+arcfill(struct entry **dents, int (*filter)(regex_t *, char *), regex_t *re)
+{
+	struct member *m;
+	char *dir;
+	size_t len;
+	int i, n = 0;
+
+	totalsize = 0;
+	namebytes = 0;
+	dir = arcdir();
+	len = strlen(dir);
+	for (i = 0; i < arc->n; i++) {
+		m = &arc->m[i];
+		/* Only direct children of dir */
+		if (len > 0 ? m->name != m->path + len + 1 ||
+		    strncmp(m->path, dir, len) != 0 : m->name != m->path)
+			continue;
+		if (filter(re, m->name) == 0)
+			continue;
+		*dents = xrealloc(*dents, (n + 1) * sizeof(**dents));
+		(*dents)[n].name = xstrdup(m->name);
+		namebytes += strlen(m->name) + 1;
+		(*dents)[n].mode = m->mode;
+		(*dents)[n].t = m->t;
+		(*dents)[n].tns = 0;
+		(*dents)[n].size = m->size;
+		/* Not files on disk */
+		(*dents)[n].dev = 0;
+		(*dents)[n].ino = 0;
+		(*dents)[n].uid = -1;
+		(*dents)[n].gid = -1;
+		(*dents)[n].mark = 0;
+		if (S_ISREG(m->mode))
+			totalsize += m->size;
+		n++;
+	}
+	return n;
+}
+
+/* Copy `len' bytes at `off' of `fd' to `out' */
+int
+arccopy(int fd, off_t off, unsigned long long len, int out)
+{
+	char buf[BUFSIZ];
+	ssize_t r;
+
+	while (len > 0) {
+		r = pread(fd, buf, MIN(sizeof(buf), len), off);
+		if (r <= 0)
+			return -1;
+		if (write(out, buf, r) != r)
+			return -1;
+		off += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Remove an extracted member and its directory */
+void
+arcclean(char *file)
+{
+	char *dir;
+
+	unlink(file);
+	dir = xdirname(file);
+	rmdir(dir);
+	xfree(dir);
+}
+
+/*
+ * Extract member `name' of the current archive to a temporary file
+ * with the same base name, so associations still apply.  Deflated zip
+ * members are left to unzip(1).
+ */
+char *
+arcextract(char *name)
+{
+	unsigned char h[30];
+	struct member *m = NULL;
+	char *dir, *file;
+	pid_t pid;
+	int i, fd, out, status, r = -1;
+
+	for (i = 0; i < arc->n; i++)
+		if (strcmp(arc->m[i].path, name) == 0) {
+			m = &arc->m[i];
+			break;
+		}
+	if (m == NULL || !S_ISREG(m->mode)) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	dir = mkpath(xgetenv("TMPDIR", "/tmp"), "noice.XXXXXXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		xfree(dir);
+		return NULL;
+	}
+	file = mkpath(dir, m->name);
+	xfree(dir);
+	out = open(file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	fd = open(arcpath, O_RDONLY);
+	if (out == -1 || fd == -1)
+		goto out;
+
+	if (arc->type == ARC_TAR) {
+		r = arccopy(fd, m->off, m->size, out);
+	} else if (m->method == 0) {
+		/* Stored, skip the local header */
+		if (pread(fd, h, sizeof(h), m->off) == sizeof(h) &&
+		    le32(h) == 0x04034b50)
+			r = arccopy(fd, m->off + 30 + le16(h + 26) +
+			    le16(h + 28), m->csize, out);
+	} else {
+		pid = fork();
+		if (pid == 0) {
+			dup2(out, 1);
+			execlp("unzip", "unzip", "-p", arcpath, m->path, NULL);
+			_exit(1);
+		}
+		if (pid > 0) {
+			while (waitpid(pid, &status, 0) == -1)
+				;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				r = 0;
+		}
+	}
+out:
+	if (fd != -1)
+		close(fd);
+	if (out != -1)
+		close(out);
+	if (r == -1) {
+		arcclean(file);
+		xfree(file);
+		return NULL;
+	}
+	return file;
+}
+
+/* Key of a name in visit snapshots, 0 marks a free slot */
+unsigned long long
+visitkey(char *name)
+{
+	struct hash h;
+	unsigned long long k;
+
+	hashinit(&h, 0);
+	hashupdate(&h, name, strlen(name));
+	k = hashfinal(&h);
+	return k != 0 ? k : 1;
+}
+
+/* What tells a changed entry, its size and mtime folded together */
+unsigned long long
+visitstamp(struct entry *ent)
+{
+	return (ent->size + 1) * 0x9e3779b97f4a7c15ULL ^
+	    (unsigned long long)ent->t;
+}
+
+/* Return an open addressing table of the records, keys are uniform */
+struct visitrec *
+visittable(struct visitrec *recs, size_t n, size_t *mask)
+{
+	struct visitrec *tab;
+	size_t i, j;
+
+	for (*mask = 15; *mask < 2 * n; *mask = *mask * 2 + 1)
+		;
+	tab = xmalloc((*mask + 1) * sizeof(*tab));
+	memset(tab, 0, (*mask + 1) * sizeof(*tab));
+	for (i = 0; i < n; i++) {
+		for (j = recs[i].key & *mask; tab[j].key != 0 &&
+		    tab[j].key != recs[i].key; j = (j + 1) & *mask)
+			;
+		tab[j] = recs[i];
+	}
+	return tab;
+}
+
+struct visitrec *
+visitget(struct visitrec *tab, size_t mask, unsigned long long key)
+{
+	size_t j;
+
+	for (j = key & mask; tab[j].key != 0; j = (j + 1) & mask)
+		if (tab[j].key == key)
+			return &tab[j];
+	return NULL;
+}
+
+/* Read the snapshot of the last visit of `dir', NULL if there is none */
+struct visitrec *
+visitload(char *dir, size_t *n)
+{
+	struct visitrec *recs;
+	struct stat sb;
+	char *file;
+	int fd;
+
+	*n = 0;
+	file = dirfile(visitdir, dir);
+	if (file == NULL)
+		return NULL;
+	fd = open(file, O_RDONLY);
+	xfree(file);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return NULL;
+	}
+	*n = sb.st_size / sizeof(*recs);
+	recs = xmalloc((*n + 1) * sizeof(*recs));
+	if (readfull(fd, recs, *n * sizeof(*recs)) == -1) {
+		xfree(recs);
+		recs = NULL;
+		*n = 0;
+	}
+	close(fd);
+	return recs;
+}
+
+/*
+ * Mark the entries that are new or changed since the last visit of
+ * `dir', joining them with its snapshot on the name hash
+ */
+void
+visitmark(char *dir, struct entry *dents, int n)
+{
+	struct visitrec *recs, *tab, *r;
+	size_t nrecs, mask;
+	int i;
+
+	if (nvisits == 0)
+		return;
+	/* Nothing is new on a first visit */
+	recs = visitload(dir, &nrecs);
+	if (recs == NULL)
+		return;
+	tab = visittable(recs, nrecs, &mask);
+	xfree(recs);
+	for (i = 0; i < n; i++) {
+		r = visitget(tab, mask, visitkey(dents[i].name));
+		if (r == NULL)
+			dents[i].mark = NEWMARK;
+		else if (r->stamp != visitstamp(&dents[i]))
+			dents[i].mark = DIFFMARK;
+	}
+	xfree(tab);
+}
+
+int
+timecmp(const void *va, const void *vb)
+{
+	const time_t *a = va, *b = vb;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+/* Drop the oldest snapshots until there are nvisits left */
+void
+visitprune(char *dir)
+{
+	struct dirent *dp;
+	struct stat sb;
+	time_t *t = NULL, cut;
+	DIR *dirp;
+	int count = 0, drop, i;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		return;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (fstatat(dirfd(dirp), dp->d_name, &sb, 0) == -1 ||
+		    !S_ISREG(sb.st_mode))
+			continue;
+		t = xrealloc(t, (count + 1) * sizeof(*t));
+		t[count++] = sb.st_mtime;
+	}
+	drop = count - nvisits;
+	if (drop > 0) {
+		/* All older than the cut go and enough of those at it */
+		qsort(t, count, sizeof(*t), timecmp);
+		cut = t[drop - 1];
+		for (i = 0; t[i] != cut; i++)
+			;
+		drop -= i;
+		rewinddir(dirp);
+		while ((dp = readdir(dirp)) != NULL) {
+			if (fstatat(dirfd(dirp), dp->d_name, &sb, 0) == -1 ||
+			    !S_ISREG(sb.st_mode))
+				continue;
+			if (sb.st_mtime < cut ||
+			    (sb.st_mtime == cut && drop-- > 0))
+				unlinkat(dirfd(dirp), dp->d_name, 0);
+		}
+	}
+	xfree(t);
+	closedir(dirp);
+}
+
+/* Return the keys of the names in `dir' that `fltr' hides */
+struct visitrec *
+visithidden(char *dir, char *fltr, size_t *n)
+{
+	struct visitrec *recs = NULL;
+	struct dirent *dp;
+	regex_t re;
+	DIR *dirp;
+
+	*n = 0;
+	if (setfilter(&re, fltr) != 0)
+		return NULL;
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		regfree(&re);
+		return NULL;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (visible(&re, dp->d_name))
+			continue;
+		recs = xrealloc(recs, (*n + 1) * sizeof(*recs));
+		recs[*n].key = visitkey(dp->d_name);
+		recs[*n].stamp = 0;
+		(*n)++;
+	}
+	closedir(dirp);
+	regfree(&re);
+	return recs;
+}
+
+/*
+ * Save a snapshot of the listing of `dir' on leaving it.  A listing read
+ * through a filter has part of the directory only, so what the last
+ * snapshot had of the names `fltr' hides is kept, and only while they
+ * are still there.
+ */
+void
+visitsave(char *dir, struct entry *dents, int n, struct pack *pk, char *fltr)
+{
+	struct visitrec *recs, *old, *hid, *tab;
+	size_t nrecs, nold, nhid, mask, i;
+	char *file, *tmp, *sub, buf[NAME_MAX + 1];
+	int fd;
+
+	if (nvisits == 0)
+		return;
+	file = dirfile(visitdir, dir);
+	if (file == NULL)
+		return;
+	recs = xmalloc((n + 1) * sizeof(*recs));
+	for (nrecs = 0; nrecs < (size_t)n; nrecs++) {
+		recs[nrecs].key = visitkey(entname(pk, &dents[nrecs], buf));
+		recs[nrecs].stamp = visitstamp(&dents[nrecs]);
+	}
+	if (strcmp(fltr, ".") != 0 && (old = visitload(dir, &nold)) != NULL) {
+		hid = visithidden(dir, fltr, &nhid);
+		tab = visittable(hid, nhid, &mask);
+		recs = xrealloc(recs, (nrecs + nold + 1) * sizeof(*recs));
+		for (i = 0; i < nold; i++)
+			if (visitget(tab, mask, old[i].key) != NULL)
+				recs[nrecs++] = old[i];
+		xfree(tab);
+		xfree(hid);
+		xfree(old);
+	}
+
+	sub = xdirname(file);
+	mkdir(sub, 0700);
+	tmp = xmalloc(strlen(file) + sizeof(".new"));
+	sprintf(tmp, "%s.new", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd != -1) {
+		if (write(fd, recs, nrecs * sizeof(*recs)) !=
+		    (ssize_t)(nrecs * sizeof(*recs)) || rename(tmp, file) == -1)
+			unlink(tmp);
+		close(fd);
+		visitprune(sub);
+	}
+	xfree(sub);
+	xfree(tmp);
+	xfree(file);
+	xfree(recs);
+}
+
+/* Append how the listing was read and how long it took to scanlog */
+void
+scanlogsave(void)
+{
+	char *home, *file;
+	int fd;
+
+	home = getenv("HOME");
+	if (scanlog == NULL || home == NULL || home[0] == '\0')
+		return;
+	file = mkpath(home, scanlog);
+	fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	xfree(file);
+	if (fd == -1)
+		return;
+	/* One write per record, O_APPEND keeps them whole */
+	dprintf(fd, "%lld %lx %s %d %ld %s\n", (long long)time(NULL),
+	    (unsigned long)scanfs, scannames[scanhow], n, scanus, path);
+	close(fd);
+}
+
+/* Read the targets of the links in the listing that are not known */
+void
+linkstart(void)
+{
+	char **names, buf[NAME_MAX + 1], *tmp;
+	int i, k = 0;
+
+	if (!showlinks || view != VIEW_DIR || spill != NULL ||
+	    jobcount(1) >= maxjobs)
+		return;
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].op == JOB_LINKS && strcmp(jobs[i].dir, path) == 0)
+			return;
+	/* Late entries wait for the stat job, they may hang as well */
+	for (i = 0; i < n; i++)
+		if (S_ISLNK(dents[i].mode) && dents[i].t != LATE &&
+		    linkget(&dents[i]) == NULL)
+			k++;
+	if (k == 0)
+		return;
+	tmp = viewtemp();
+	if (tmp == NULL)
+		return;
+	names = xmalloc(k * sizeof(*names));
+	for (i = 0, k = 0; i < n; i++)
+		if (S_ISLNK(dents[i].mode) && dents[i].t != LATE &&
+		    linkget(&dents[i]) == NULL)
+			names[k++] = xstrdup(entname(pack, &dents[i], buf));
+	if (jobstart(JOB_LINKS, path, names, k, tmp) == -1)
+		unlink(tmp);
+	for (i = 0; i < k; i++)
+		xfree(names[i]);
+	xfree(names);
+	xfree(tmp);
+}
+
+/* Ask again in the background for the entries the scan gave up on */
+void
+statstart(void)
+{
+	char **names, buf[NAME_MAX + 1], *tmp;
+	int i, k = 0;
+
+	if (view != VIEW_DIR || spill != NULL || jobcount(1) >= maxjobs)
+		return;
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].op == JOB_STAT && strcmp(jobs[i].dir, path) == 0)
+			return;
+	for (i = 0; i < n; i++)
+		if (dents[i].t == LATE)
+			k++;
+	if (k == 0)
+		return;
+	tmp = viewtemp();
+	if (tmp == NULL)
+		return;
+	names = xmalloc(k * sizeof(*names));
+	for (i = 0, k = 0; i < n; i++)
+		if (dents[i].t == LATE)
+			names[k++] = xstrdup(entname(pack, &dents[i], buf));
+	if (jobstart(JOB_STAT, path, names, k, tmp) == -1)
+		unlink(tmp);
+	for (i = 0; i < k; i++)
+		xfree(names[i]);
+	xfree(names);
+	xfree(tmp);
+}
+
+int
+populate(void)
+{
+	struct listing *l = NULL;
+	struct timespec ts, scanned;
+	struct stat sb;
+	regex_t re;
+	int r, stamped, visit;
+
+	/* Can fail when permissions change while browsing */
+	if (view != VIEW_ARC && canopendir(path) == 0)
+		return -1;
+
+	/* Search filter */
+	r = setfilter(&re, fltr);
+	if (r != 0)
+		return -1;
+
+	/* Leaving a directory, remember what it held */
+	if (visitpath != NULL &&
+	    (view != VIEW_DIR || strcmp(visitpath, path) != 0)) {
+		visitsave(visitpath, dents, n, pack, visitfltr);
+		xfree(visitpath);
+		visitpath = NULL;
+		xfree(visitfltr);
+		visitfltr = NULL;
+	}
+
+	/* Selections survive rescans of the same directory only */
+	if (selpath == NULL || strcmp(selpath, path) != 0 || selview != view) {
+		selclear();
+		xfree(selpath);
+		selpath = xstrdup(path);
+		selview = view;
+	} else {
+		selsave();
+	}
+
+	listsync();
+	listput(list);
+	list = NULL;
+
+	n = 0;
+	dents = NULL;
+	pack = NULL;
+	spill = NULL;
+	gen = ++listgen;
 
-	if (cm == 0 || cm == '*')
-	{
-		size = printsize(ent->size);
-		mvprintw(row, COLS-16, "%s\n", size);
-		free(size);
+	/* A tab on the same directory read it, if it did not change since */
+	stamped = view == VIEW_DIR && stat(path, &sb) == 0;
+	clock_gettime(CLOCK_MONOTONIC, &scanned);
+	if (stamped && !rescan)
+		l = listfind(&sb);
+	rescan = 0;
+	if (l != NULL) {
+		list = l;
+		list->refs++;
+		dents = list->dents;
+		pack = list->pack;
+		spill = list->spill;
+		n = list->n;
+		totalsize = list->totalsize;
+		namebytes = list->namebytes;
+		gen = list->gen;
+		scanhow = SCAN_SHARED;
+		scanus = sortus = 0;
+		regfree(&re);
+		goto shared;
 	}
-	else
-		printw("\n");
 
-	free(name);
-}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (view == VIEW_DIR) {
+		n = scanfill(path, &dents, visible, &re);
+		scanhow = SCAN_NOICED;
+		scanfs = 0;
+		nlate = 0;
+		if (n == -1)
+			n = dentfill(path, &dents, visible, &re);
+	} else if (view == VIEW_ARC)
+		n = arcfill(&dents, visible, &re);
+	else
+		n = viewfill(path, viewfile, &dents, visible, &re);
+	scanus = usecsince(&ts);
+	if (view == VIEW_DIR)
+		scanlogsave();
 
-int
-dentfill(char *path, struct entry **dents,
-	 int (*filter)(regex_t *, char *), regex_t *re)
-{
-	DIR *dirp;
-	struct dirent *dp;
-	struct stat sb;
-	char *newpath;
-	int r, n = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* A spilled listing is sorted by merging its runs */
+	if (spill != NULL) {
+		r = spillend(dents, n);
+		xfree(dents);
+		dents = NULL;
+		n = r == 0 ? spill->n : 0;
+		if (r == -1) {
+			spillfree(spill);
+			spill = NULL;
+			regfree(&re);
+			return -1;
+		}
+	} else if (view == VIEW_DIR || view == VIEW_ARC) {
+		/* Views come in their own order */
+		qsort(dents, n, sizeof(*dents), entrycmp);
+	}
+	sortus = usecsince(&ts);
 
-	totalsize = 0;
-	dirp = opendir(path);
-	if (dirp == NULL)
-		return 0;
+	/* What removing all but one of each group would free */
+	if (view == VIEW_DUPS)
+		totalsize = dupsize();
+	/*
+	 * Snapshots are built in memory, spilled listings get none and
+	 * listings without all sizes and times cannot tell changes
+	 */
+	visit = view == VIEW_DIR && spill == NULL &&
+	    scanhow != SCAN_NOSTAT && nlate == 0;
+	if (visit)
+		visitmark(path, dents, n);
+	regfree(&re);
+	/* Huge directories keep their names front-coded */
+	if (view == VIEW_DIR && spill == NULL && !mtimeorder && packmin > 0 &&
+	    n >= packmin && (pack = packdents(dents, n)) != NULL)
+		namebytes = pack->len + (n / PACKBLK + 1) * sizeof(size_t);
 
-	while ((dp = readdir(dirp)) != NULL) {
-		/* Skip self and parent */
-		if (strcmp(dp->d_name, ".") == 0
-		    || strcmp(dp->d_name, "..") == 0)
-			continue;
-		if (filter(re, dp->d_name) == 0)
-			continue;
-		*dents = xrealloc(*dents, (n + 1) * sizeof(**dents));
-		(*dents)[n].name = xstrdup(dp->d_name);
-		/* Get mode flags */
-		newpath = mkpath(path, dp->d_name);
-		r = lstat(newpath, &sb);
-		if (r == -1)
-			printerr(1, "lstat");
-		(*dents)[n].mode = sb.st_mode;
-		(*dents)[n].t = sb.st_mtime;
-		(*dents)[n].size = sb.st_size;
+	/* Only directory listings are looked for by other tabs */
+	list = xmalloc(sizeof(*list));
+	memset(list, 0, sizeof(*list));
+	list->refs = 1;
+	list->visit = visit;
+	if (stamped) {
+		list->path = xstrdup(path);
+		list->fltr = xstrdup(fltr);
+		list->mtimeorder = mtimeorder;
+		list->owner = showowner;
+		list->dev = sb.st_dev;
+		list->ino = sb.st_ino;
+		list->mtim = sb.st_mtim;
+		list->scanned = scanned;
+	}
+	listsync();
 
-		if (filemode(sb.st_mode) == 0 | filemode(sb.st_mode) == '*')
-			totalsize += sb.st_size;
-		n++;
+shared:
+	if (list->visit) {
+		if (visitpath == NULL)
+			visitpath = xstrdup(path);
+		xfree(visitfltr);
+		visitfltr = xstrdup(fltr);
+	} else if (view == VIEW_DIR) {
+		xfree(visitpath);
+		visitpath = NULL;
+		xfree(visitfltr);
+		visitfltr = NULL;
 	}
+	selload();
+#ifdef DEBUG
+	memreport();
+#endif
 
-	/* Should never be null */
-	r = closedir(dirp);
-	if (r == -1)
-		printerr(1, "closedir");
+	/* Find cur from history */
+	cur = dentfind(dents, n, pack, spill, path, oldpath);
+	xfree(oldpath);
+	oldpath = NULL;
 
-	return n;
+	/* Targets of symlinks come in later, the scan does not wait */
+	linkstart();
+	statstart();
+
+	return 0;
 }
 
+/* Print scan and render metrics of the current listing */
 void
-dentfree(struct entry *dents, int n)
+printstats(void)
 {
-	int i;
+	char buf[LINE_MAX];
+	unsigned long rate, mem;
 
-	for (i = 0; i < n; i++)
-		free(dents[i].name);
-	free(dents);
+	rate = scanus > 0 ? n * 1000000.0 / scanus : 0;
+	mem = (n * sizeof(*dents) + namebytes) / 1024;
+	/* A spilled listing holds a page and the index */
+	if (spill != NULL)
+		mem = (sizeof(*spill) + (n / SPILLWIN + 1) *
+		    sizeof(*spill->index)) / 1024;
+	snprintf(buf, sizeof(buf),
+	    "%d ents %lu/s scan %ldms %s sort %ldms draw %ldms mem %luK jobs %d",
+	    n, rate, scanus / 1000, scannames[scanhow], sortus / 1000,
+	    drawus / 1000, mem, njobs);
+	if (spill != NULL)
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+		    " spill %luK", (unsigned long)(spill->size / 1024));
+	if (cachehits + cachemiss > 0)
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+		    " cache %lu%%", cachehits * 100 / (cachehits + cachemiss));
+	if (inputus > 0)
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+		    " input %ldus", inputus);
+#ifdef DEBUG
+	snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+	    " live %luK", memlive() / 1024);
+#endif
+	/* No text wrapping in the metrics line */
+	printw("%.*s", COLS - 1, buf);
 }
 
-char *
-mkpath(char *dir, char *name)
+int
+ordercmp(const void *va, const void *vb)
 {
-	char path[PATH_MAX];
+	return strcmp(orderdents[*(int *)va].name,
+	    orderdents[*(int *)vb].name);
+}
 
-	/* Handle absolute path */
-	if (name[0] == '/') {
-		strlcpy(path, name, sizeof(path));
-	} else {
-		/* Handle root case */
-		if (strcmp(dir, "/") == 0) {
-			strlcpy(path, "/", sizeof(path));
-			strlcat(path, name, sizeof(path));
-		} else {
-			strlcpy(path, dir, sizeof(path));
-			strlcat(path, "/", sizeof(path));
-			strlcat(path, name, sizeof(path));
-		}
+/*
+ * Keep an index of the listing of `t' in name order for pane `p', or
+ * take the one of pane `o' if it shows the same listing
+ */
+void
+paneorder(struct pane *p, struct tab *t, struct pane *o)
+{
+	int i;
+
+	if (p->order != NULL && p->ordergen == t->gen)
+		return;
+	xfree(p->order);
+	p->order = xmalloc((t->n + 1) * sizeof(*p->order));
+	/* Generations are not reused, the same one is the same listing */
+	if (o->order != NULL && o->ordergen == t->gen && t->gen != 0) {
+		memcpy(p->order, o->order, t->n * sizeof(*p->order));
+		p->ordergen = t->gen;
+		return;
 	}
-	return xstrdup(path);
+	for (i = 0; i < t->n; i++)
+		p->order[i] = i;
+	/*
+	 * Directories are sorted by name already.  A spilled one in time
+	 * order is not sorted again in memory and has no name order.
+	 */
+	if ((t->mtimeorder && t->spill == NULL) ||
+	    (t->view != VIEW_DIR && t->view != VIEW_ARC)) {
+		orderdents = t->dents;
+		qsort(p->order, t->n, sizeof(*p->order), ordercmp);
+	}
+	p->ordergen = t->gen;
 }
 
-/* Return the position of the matching entry or 0 otherwise */
+/* Return the index of the entry called `name' in pane `p', or -1 */
 int
-dentfind(struct entry *dents, int n, char *cwd, char *path)
+panefind(struct pane *p, struct tab *t, char *name)
 {
-	int i;
-	char *tmp;
+	char buf[NAME_MAX + 1];
+	int lo = 0, hi = t->n - 1, mid, r;
 
-	if (path == NULL)
-		return 0;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		r = strcmp(name, entname(t->pack, dentat(t->spill, t->dents,
+		    p->order[mid]), buf));
+		if (r == 0)
+			return p->order[mid];
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
 
-	for (i = 0; i < n; i++) {
-		tmp = mkpath(cwd, dents[i].name);
-		DPRINTF_S(path);
-		DPRINTF_S(tmp);
-		if (strcmp(tmp, path) == 0) {
-			free(tmp);
-			return i;
+/*
+ * Mark the entries only one of the listings of `ta' and `tb' has or
+ * that differ, walking both once in name order through the indexes
+ * `ia' and `ib'
+ */
+void
+dentmerge(struct tab *ta, int *ia, char *ma, struct tab *tb, int *ib,
+    char *mb)
+{
+	struct entry *a = ta->dents, *b = tb->dents;
+	char bufa[NAME_MAX + 1], bufb[NAME_MAX + 1];
+	int i = 0, j = 0, na = ta->n, nb = tb->n, r;
+
+	while (i < na || j < nb) {
+		if (i == na)
+			r = 1;
+		else if (j == nb)
+			r = -1;
+		else
+			r = strcmp(entname(ta->pack, dentat(ta->spill, a, ia[i]),
+			    bufa), entname(tb->pack, dentat(tb->spill, b, ib[j]),
+			    bufb));
+		if (r < 0) {
+			ma[ia[i++]] = ONLYMARK;
+		} else if (r > 0) {
+			mb[ib[j++]] = ONLYMARK;
+		} else {
+			ma[ia[i]] = mb[ib[j]] = dentdiffer(dentat(ta->spill, a,
+			    ia[i]), dentat(tb->spill, b, ib[j])) ? DIFFMARK : 0;
+			i++;
+			j++;
 		}
-		free(tmp);
 	}
-
-	return 0;
 }
 
-int
-populate(void)
+/* Draw tab `t' in pane `p' unless nothing there changed */
+void
+drawpane(struct pane *p, struct tab *t, int active, int x, int w, int rows)
 {
-	regex_t re;
-	int r;
+	struct entry *ent;
+	char *size;
+	int i, top, nlines;
 
-	/* Can fail when permissions change while browsing */
-	if (canopendir(path) == 0)
-		return -1;
+	nlines = MIN(rows, t->n);
+	if (t->cur < nlines / 2)
+		top = 0;
+	else if (t->cur >= t->n - nlines / 2)
+		top = t->n - nlines;
+	else
+		top = t->cur - nlines / 2;
 
-	/* Search filter */
-	r = setfilter(&re, fltr);
-	if (r != 0)
-		return -1;
+	if (p->gen == t->gen && p->cur == t->cur && p->top == top &&
+	    p->nsel == t->nsel && p->rows == rows && p->x == x &&
+	    p->w == w && p->active == active && p->hash == showhash &&
+	    p->cmp == cmpmode && p->nsums == ncksums && p->nlinks == nlinks &&
+	    p->own == showowner && p->idgen == idgen)
+		return;
+	p->gen = t->gen;
+	p->cur = t->cur;
+	p->top = top;
+	p->nsel = t->nsel;
+	p->rows = rows;
+	p->x = x;
+	p->w = w;
+	p->active = active;
+	p->hash = showhash;
+	p->cmp = cmpmode;
+	p->nsums = ncksums;
+	p->nlinks = nlinks;
+	p->own = showowner;
+	p->idgen = idgen;
 
-	dentfree(dents, n);
+	/* No text wrapping in cwd line, the active one stands out */
+	mvprintw(0, x, "%*s", w, "");
+	if (active)
+		attron(A_REVERSE);
+	mvprintw(0, x, CWD "%.*s", w - (int)strlen(CWD) - 17, t->path);
+	if (active)
+		attroff(A_REVERSE);
+	size = printsize(t->totalsize);
+	mvprintw(0, x + w - 16, "%s", size);
+	xfree(size);
 
-	n = 0;
-	dents = NULL;
+	for (i = 0; i < rows; i++) {
+		move(2 + i, x);
+		if (i < nlines) {
+			ent = dentat(t->spill, t->dents, top + i);
+			printent(ent, t->pack, top + i == t->cur,
+			    TABSEL(t, top + i), x, w, cmpmode ?
+			    p->marks[top + i] : ent->mark);
+		} else
+			printw("%*s", w, "");
+	}
+}
+
+/* Draw the current tab and the other one side by side */
+void
+drawsplit(int rows)
+{
+	struct tab *t[2];
+	char buf[NAME_MAX + 1];
+	int i, j, x[2], w[2], byname;
 
-	n = dentfill(path, &dents, visible, &re);
+	/* A neighbour takes the place of a closed tab */
+	if (othertab < 0 || othertab >= ntabs || othertab == curtab)
+		othertab = curtab > 0 ? curtab - 1 : curtab + 1;
+	tabsave(curtab);
+	t[0] = &tabs[MIN(curtab, othertab)];
+	t[1] = &tabs[MAX(curtab, othertab)];
+	j = t[1] == &tabs[curtab];
+	x[0] = 0;
+	w[0] = COLS / 2;
+	x[1] = w[0];
+	w[1] = COLS - w[0];
+	for (i = 0; i < 2; i++)
+		paneorder(&panes[i], t[i], &panes[!i]);
+	/* See paneorder() */
+	byname = !(t[0]->spill != NULL && t[0]->mtimeorder) &&
+	    !(t[1]->spill != NULL && t[1]->mtimeorder);
 
-	qsort(dents, n, sizeof(*dents), entrycmp);
+	/* The other cursor follows to the same name if it is there */
+	if (syncpanes && byname && t[j]->n > 0 &&
+	    (panes[j].gen != t[j]->gen || panes[j].cur != t[j]->cur)) {
+		i = panefind(&panes[!j], t[!j], entname(t[j]->pack,
+		    dentat(t[j]->spill, t[j]->dents, t[j]->cur), buf));
+		if (i != -1)
+			t[!j]->cur = i;
+	}
 
-	/* Find cur from history */
-	cur = dentfind(dents, n, path, oldpath);
-	free(oldpath);
-	oldpath = NULL;
+	if (cmpmode && (cmpgen[0] != t[0]->gen || cmpgen[1] != t[1]->gen)) {
+		for (i = 0; i < 2; i++) {
+			xfree(panes[i].marks);
+			panes[i].marks = xmalloc(t[i]->n + 1);
+			memset(panes[i].marks, 0, t[i]->n + 1);
+			panes[i].gen = 0;
+		}
+		/* Both panes on one listing have nothing to mark */
+		if (byname && t[0]->gen != t[1]->gen)
+			dentmerge(t[0], panes[0].order, panes[0].marks,
+			    t[1], panes[1].order, panes[1].marks);
+		cmpgen[0] = t[0]->gen;
+		cmpgen[1] = t[1]->gen;
+	}
 
-	return 0;
+	for (i = 0; i < 2; i++)
+		drawpane(&panes[i], t[i], i == j, x[i], w[i], rows);
+
+	/* Whatever is under the panes is drawn again */
+	move(1, 0);
+	clrtoeol();
+	if (showstats)
+		printstats();
+	for (i = 2 + rows; i < LINES; i++) {
+		move(i, 0);
+		clrtoeol();
+	}
 }
 
 void
 redraw(void)
 {
+	struct entry *ent;
+	struct timespec ts;
 	int nlines, odd;
-	char *cwd;
+	char *cwd, *size;
 	int i;
 
-	nlines = MIN(LINES - 4, n);
-
-	/* Clean screen */
-	erase();
+	MEMTAG(MEM_RENDER);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	nlines = MIN(LINES - 4 - njobs, n);
 
 	/* Strip trailing slashes */
 	for (i = strlen(path) - 1; i > 0; i--)
@@ -666,41 +7342,94 @@ redraw(void)
 	DPRINTF_D(cur);
 	DPRINTF_S(path);
 
+	if (split && ntabs > 1) {
+		drawsplit(LINES - 4 - njobs);
+		goto done;
+	}
+
+	/* Clean screen, the panes are drawn anew after this */
+	erase();
+	panes[0].gen = panes[1].gen = 0;
+
 	/* No text wrapping in cwd line */
 	cwd = xmalloc(COLS * sizeof(char));
 	strlcpy(cwd, path, COLS * sizeof(char));
 	cwd[COLS - strlen(CWD) - 1] = '\0';
 
 	printw(CWD "%s", cwd);
-	mvprintw(0, COLS-16, "%s\n\n", printsize(totalsize));
+	xfree(cwd);
+	if (ntabs > 1)
+		printw(" [%d/%d]", curtab + 1, ntabs);
+	if (view == VIEW_DUPS)
+		printw(" [duplicates]");
+	else if (view == VIEW_LARGEST)
+		printw(" [largest]");
+	else if (view == VIEW_RECENT)
+		printw(" [recent]");
+	else if (view == VIEW_DIFF)
+		printw(" [compare]");
+	size = printsize(totalsize);
+	if (nsel > 0)
+		mvprintw(0, COLS - 32, "%10d sel", nsel);
+	mvprintw(0, COLS-16, "%s\n", size);
+	xfree(size);
+	if (showstats)
+		printstats();
+	printw("\n");
 
 	/* Print listing */
 	odd = ISODD(nlines);
 	if (cur < nlines / 2) {
-		for (i = 0; i < nlines; i++)
-			printent(&dents[i], i == cur);
+		for (i = 0; i < nlines; i++) {
+			ent = dentat(spill, dents, i);
+			printent(ent, pack, i == cur, ISSEL(i), 0, COLS,
+			    ent->mark);
+		}
 	} else if (cur >= n - nlines / 2) {
-		for (i = n - nlines; i < n; i++)
-			printent(&dents[i], i == cur);
+		for (i = n - nlines; i < n; i++) {
+			ent = dentat(spill, dents, i);
+			printent(ent, pack, i == cur, ISSEL(i), 0, COLS,
+			    ent->mark);
+		}
 	} else {
 		for (i = cur - nlines / 2;
-		     i < cur + nlines / 2 + odd; i++)
-			printent(&dents[i], i == cur);
+		     i < cur + nlines / 2 + odd; i++) {
+			ent = dentat(spill, dents, i);
+			printent(ent, pack, i == cur, ISSEL(i), 0, COLS,
+			    ent->mark);
+		}
+	}
+done:
+	printjobs();
+	ctlnotify();
+
+	drawus = usecsince(&ts);
+	if (remotetv.tv_sec != 0) {
+		inputus = usecsince(&remotetv);
+		remotetv.tv_sec = 0;
+#ifdef DEBUG
+		dprintf(DEBUG_FD, "input %ldus\n", inputus);
+#endif
 	}
+	MEMTAG(MEM_LIST);
 }
 
 void
 browse(const char *ipath, const char *ifilter)
 {
-	int r, fd;
+	int r, fd, i;
 	regex_t re;
 	char *newpath;
 	struct stat sb;
-	char *name, *bin, *dir, *tmp, *run, *env, *args;
+	struct archive *a;
+	char *name, *bin, *dir, *tmp, *run, *env, *args, *save;
+	char **names, buf[NAME_MAX + 1];
+	size_t len = 0;
 	int nowtyping = 0;
+	int sel;
 
 	oldpath = NULL;
-	path = xstrdup(ipath);
+	pathset(xstrdup(ipath));
 	fltr = xstrdup(ifilter);
 begin:
 	/* Path and filter should be malloc(3)-ed strings at all times */
@@ -719,29 +7448,74 @@ begin:
 		if (nowtyping)
 			goto moretyping;
 nochange:
-		switch (nextsel(&run, &env, &args)) {
+		switch (sel = nextsel(&run, &env, &args)) {
 		case SEL_QUIT:
-			free(path);
-			free(fltr);
-			dentfree(dents, n);
+			xfree(oldpath);
+			tabsave(curtab);
+			for (i = 0; i < ntabs; i++)
+				tabfree(&tabs[i]);
+			for (i = 0; i < 2; i++) {
+				xfree(panes[i].order);
+				xfree(panes[i].marks);
+			}
+			/* Jobs run to completion on their own */
+			for (i = 0; i < njobs; i++) {
+				/* Except those filling in the listing */
+				if (JOBINTERNAL(jobs[i].op)) {
+					kill(-jobs[i].pid, SIGTERM);
+					unlink(jobs[i].dest);
+				}
+				jobfree(&jobs[i]);
+			}
+			xfree(cksums);
+			linkclear();
+			idclear();
+			for (i = 0; i < ARCCACHE; i++)
+				arcput(arcs[i]);
+			ctlclose();
+			xfree(jobs);
+#ifdef DEBUG
+			memreport();
+			/* Everything is released by now, report leaks */
+			if (memlive() != 0) {
+				exitcurses();
+				fprintf(stderr, "leaked %lu bytes\n", memlive());
+				exit(2);
+			}
+#endif
 			return;
 		case SEL_BACK:
+			/* Up inside an archive, out at its root */
+			if (view == VIEW_ARC) {
+				oldpath = xstrdup(path);
+				pathpop();
+				if (strlen(path) < strlen(arcpath))
+					viewclose();
+				xfree(fltr);
+				fltr = xstrdup(ifilter);
+				goto begin;
+			}
+			/* Leave a view for the listing it started from */
+			if (view != VIEW_DIR) {
+				viewclose();
+				goto begin;
+			}
 			/* There is no going back */
 			if (strcmp(path, "/") == 0 ||
 			    strcmp(path, ".") == 0 ||
 			    strchr(path, '/') == NULL)
 				goto nochange;
-			dir = xdirname(path);
-			if (canopendir(dir) == 0) {
-				free(dir);
+			/* Save history, up in place */
+			oldpath = xstrdup(path);
+			pathpop();
+			if (canopendir(path) == 0) {
 				printwarn();
+				pathset(oldpath);
+				oldpath = NULL;
 				goto nochange;
 			}
-			/* Save history */
-			oldpath = path;
-			path = dir;
 			/* Reset filter */
-			free(fltr);
+			xfree(fltr);
 			fltr = xstrdup(ifilter);
 			goto begin;
 		case SEL_GOIN:
@@ -749,22 +7523,54 @@ nochange:
 			if (n == 0)
 				goto nochange;
 
-			name = dents[cur].name;
-			newpath = mkpath(path, name);
-			DPRINTF_S(newpath);
+			name = curname(buf);
+			/* In place, unless a view names it by full path */
+			save = name[0] == '/' ? xstrdup(path) : NULL;
+			if (save != NULL)
+				pathset(xstrdup(name));
+			else
+				len = pathpush(name);
+			DPRINTF_S(path);
+
+			if (view == VIEW_ARC) {
+				if (S_ISDIR(dentat(spill, dents, cur)->mode)) {
+					xfree(save);
+					xfree(fltr);
+					fltr = xstrdup(ifilter);
+					goto begin;
+				}
+				bin = openwith(path);
+				if (bin == NULL) {
+					printmsg("No association");
+					pathback(len, save);
+					goto nochange;
+				}
+				tmp = arcextract(path + strlen(arcpath) + 1);
+				pathback(len, save);
+				if (tmp == NULL) {
+					printwarn();
+					goto nochange;
+				}
+				exitcurses();
+				spawn(bin, tmp, NULL, NULL);
+				initcurses();
+				arcclean(tmp);
+				xfree(tmp);
+				continue;
+			}
 
 			/* Get path info */
-			fd = open(newpath, O_RDONLY | O_NONBLOCK);
+			fd = pathopen(path, O_RDONLY | O_NONBLOCK);
 			if (fd == -1) {
 				printwarn();
-				free(newpath);
+				pathback(len, save);
 				goto nochange;
 			}
 			r = fstat(fd, &sb);
 			if (r == -1) {
 				printwarn();
 				close(fd);
-				free(newpath);
+				pathback(len, save);
 				goto nochange;
 			}
 			close(fd);
@@ -772,31 +7578,43 @@ nochange:
 
 			switch (sb.st_mode & S_IFMT) {
 			case S_IFDIR:
-				if (canopendir(newpath) == 0) {
+				if (canopendir(path) == 0) {
 					printwarn();
-					free(newpath);
+					pathback(len, save);
 					goto nochange;
 				}
-				free(path);
-				path = newpath;
+				xfree(save);
+				viewclose();
 				/* Reset filter */
-				free(fltr);
+				xfree(fltr);
 				fltr = xstrdup(ifilter);
 				goto begin;
 			case S_IFREG:
-				bin = openwith(newpath);
+				/* Archives are browsed like directories */
+				if ((a = arcget(path, &sb)) != NULL) {
+					xfree(save);
+					viewclose();
+					view = VIEW_ARC;
+					arc = a;
+					arcpath = xstrdup(path);
+					xfree(fltr);
+					fltr = xstrdup(ifilter);
+					goto begin;
+				}
+				bin = openwith(path);
 				if (bin == NULL) {
 					printmsg("No association");
-					free(newpath);
+					pathback(len, save);
 					goto nochange;
 				}
 				exitcurses();
-				spawn(bin, newpath, NULL, NULL);
+				spawn(bin, path, NULL, NULL);
 				initcurses();
-				free(newpath);
+				pathback(len, save);
 				continue;
 			default:
 				printmsg("Unsupported file");
+				pathback(len, save);
 				goto nochange;
 			}
 		case SEL_FLTR:
@@ -808,15 +7626,16 @@ nochange:
 			/* Check and report regex errors */
 			r = setfilter(&re, tmp);
 			if (r != 0) {
-				free(tmp);
+				xfree(tmp);
 				goto nochange;
 			}
-			free(fltr);
+			regfree(&re);
+			xfree(fltr);
 			fltr = tmp;
 			DPRINTF_S(fltr);
 			/* Save current */
 			if (n > 0)
-				oldpath = mkpath(path, dents[cur].name);
+				oldpath = mkpath(path, curname(buf));
 			goto begin;
 		case SEL_TYPE:
 			nowtyping = 1;
@@ -837,21 +7656,22 @@ moretyping:
 					if (nowtyping) {
 						goto moretyping;
 					} else {
-						free(tmp);
+						xfree(tmp);
 						goto nochange;
 					}
+				regfree(&re);
 			}
 			/* Copy or reset filter */
-			free(fltr);
+			xfree(fltr);
 			if (tmp != NULL)
 				fltr = xstrdup(tmp);
 			else
 				fltr = xstrdup(ifilter);
 			/* Save current */
 			if (n > 0)
-				oldpath = mkpath(path, dents[cur].name);
+				oldpath = mkpath(path, curname(buf));
 			if (!nowtyping)
-				free(tmp);
+				xfree(tmp);
 			goto begin;
 		case SEL_NEXT:
 			if (cur < n - 1)
@@ -884,15 +7704,15 @@ moretyping:
 				goto nochange;
 			}
 			newpath = mkpath(path, tmp);
-			free(tmp);
+			xfree(tmp);
 			if (canopendir(newpath) == 0) {
-				free(newpath);
+				xfree(newpath);
 				printwarn();
 				goto nochange;
 			}
-			free(path);
-			path = newpath;
-			free(fltr);
+			viewclose();
+			pathset(newpath);
+			xfree(fltr);
 			fltr = xstrdup(ifilter); /* Reset filter */
 			DPRINTF_S(path);
 			goto begin;
@@ -904,14 +7724,15 @@ moretyping:
 			}
 			newpath = mkpath(path, tmp);
 			if (canopendir(newpath) == 0) {
-				free(newpath);
+				xfree(newpath);
 				printwarn();
 				goto nochange;
 			}
-			free(oldpath);
-			oldpath = path;
-			path = newpath;
-			free(fltr);
+			viewclose();
+			xfree(oldpath);
+			oldpath = xstrdup(path);
+			pathset(newpath);
+			xfree(fltr);
 			fltr = xstrdup(ifilter); /* Reset filter */
 			DPRINTF_S(path);
 			goto begin;	
@@ -919,35 +7740,339 @@ moretyping:
 			mtimeorder = !mtimeorder;
 			/* Save current */
 			if (n > 0)
-				oldpath = mkpath(path, dents[cur].name);
+				oldpath = mkpath(path, curname(buf));
 			goto begin;
 		case SEL_REDRAW:
+			/* Links may have been fixed or broken since */
+			linkclear();
+			rescan = 1;
 			/* Save current */
 			if (n > 0)
-				oldpath = mkpath(path, dents[cur].name);
+				oldpath = mkpath(path, curname(buf));
 			goto begin;
 		case SEL_RUN:
 			run = xgetenv(env, run);
+			/* Next to the archive when inside one */
+			if (view == VIEW_ARC)
+				dir = xdirname(arcpath);
+			else
+				dir = xstrdup(path);
 			exitcurses();
-			spawn(run, NULL, path, args);
+			spawn(run, NULL, dir, args);
 			initcurses();
+			xfree(dir);
 			break;
 		case SEL_RUNARG:
-			name = dents[cur].name;
+			if (n == 0)
+				goto nochange;
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
 			run = xgetenv(env, run);
 			exitcurses();
-			spawn(run, name, path, args);
+			if (nsel > 0) {
+				r = selnames(&names);
+				spawnargs(run, names, r, path, args);
+				xfree(names);
+			} else {
+				spawn(run, curname(buf), path, args);
+			}
 			initcurses();
 			break;
 		case SEL_TOGGLEDOT:
 			if (strcmp(fltr, ifilter) != 0) {
-				free(fltr);
+				xfree(fltr);
 				fltr = xstrdup(ifilter); /* Reset filter */
 			} else {
-				free(fltr);
+				xfree(fltr);
 				fltr = xstrdup(".");
 			}
 			goto begin;
+		case SEL_STATS:
+			showstats = !showstats;
+			break;
+		case SEL_COPY:
+		case SEL_MOVE:
+			if (n == 0)
+				goto nochange;
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			/* Read target, a directory or a new name */
+			printprompt(sel == SEL_COPY ? "copy to: " : "move to: ");
+			tmp = readln();
+			if (tmp == NULL) {
+				clearprompt();
+				goto nochange;
+			}
+			newpath = mkpath(path, tmp);
+			xfree(tmp);
+			r = selnames(&names);
+			jobstart(sel == SEL_COPY ? JOB_COPY : JOB_MOVE,
+			    path, names, r, newpath);
+			xfree(names);
+			xfree(newpath);
+			selclear();
+			break;
+		case SEL_DELETE:
+			if (n == 0)
+				goto nochange;
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			i = selnames(&names);
+			tmp = xmalloc(strlen(names[0]) + LINE_MAX);
+			if (i == 1)
+				sprintf(tmp, "delete %s?", names[0]);
+			else
+				sprintf(tmp, "delete %d files?", i);
+			r = confirm(tmp);
+			xfree(tmp);
+			if (r == 0) {
+				xfree(names);
+				goto nochange;
+			}
+			jobstart(JOB_DELETE, path, names, i, NULL);
+			xfree(names);
+			selclear();
+			break;
+		case SEL_MARK:
+			if (n == 0)
+				goto nochange;
+			if (ISSEL(cur)) {
+				SELCLR(cur);
+				nsel--;
+			} else {
+				SELSET(cur);
+				nsel++;
+			}
+			selanchor = cur;
+			if (cur < n - 1)
+				cur++;
+			break;
+		case SEL_MARKRANGE:
+			if (n == 0)
+				goto nochange;
+			if (selanchor == -1 || selanchor >= n)
+				selanchor = cur;
+			for (i = MIN(selanchor, cur);
+			     i <= MAX(selanchor, cur); i++) {
+				if (!ISSEL(i)) {
+					SELSET(i);
+					nsel++;
+				}
+			}
+			selanchor = cur;
+			break;
+		case SEL_MARKALL:
+			/* Everything the filter lets through */
+			memset(selbits, 0xff, n / 8);
+			for (i = n / 8 * 8; i < n; i++)
+				SELSET(i);
+			nsel = n;
+			break;
+		case SEL_MARKCLR:
+			selclear();
+			break;
+		case SEL_HASH:
+			if (n == 0)
+				goto nochange;
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			if (cksumload() == -1) {
+				printmsg("Cannot read checksums");
+				goto nochange;
+			}
+			showhash = 1;
+			r = selnames(&names);
+			jobstart(JOB_HASH, path, names, r, NULL);
+			xfree(names);
+			selclear();
+			break;
+		case SEL_DUPS:
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			tmp = viewtemp();
+			if (tmp == NULL) {
+				printwarn();
+				goto nochange;
+			}
+			name = ".";
+			if (jobstart(JOB_DUPS, path, &name, 1, tmp) == -1)
+				unlink(tmp);
+			xfree(tmp);
+			break;
+		case SEL_LARGEST:
+		case SEL_RECENT:
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			tmp = viewtemp();
+			if (tmp == NULL) {
+				printwarn();
+				goto nochange;
+			}
+			name = ".";
+			if (jobstart(sel == SEL_LARGEST ? JOB_LARGEST :
+			    JOB_RECENT, path, &name, 1, tmp) == -1)
+				unlink(tmp);
+			xfree(tmp);
+			break;
+		case SEL_SNAP:
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			tmp = dirfile(snapdir, path);
+			if (tmp == NULL) {
+				printmsg("HOME not set");
+				goto nochange;
+			}
+			dir = xdirname(tmp);
+			mkdir(dir, 0700);
+			xfree(dir);
+			name = ".";
+			jobstart(JOB_SNAP, path, &name, 1, tmp);
+			xfree(tmp);
+			break;
+		case SEL_DIFF:
+		case SEL_DIFFTREE:
+			if (view == VIEW_ARC) {
+				printmsg("Not in archives");
+				goto nochange;
+			}
+			/* The other pane, or the snapshot of this directory */
+			dir = NULL;
+			if (split && ntabs > 1 && othertab >= 0 &&
+			    othertab < ntabs && tabs[othertab].view != VIEW_ARC) {
+				name = tabs[othertab].path;
+			} else {
+				name = dir = dirfile(snapdir, path);
+				if (dir == NULL || access(dir, R_OK) == -1) {
+					xfree(dir);
+					printmsg("No other pane or snapshot");
+					goto nochange;
+				}
+			}
+			tmp = viewtemp();
+			if (tmp == NULL) {
+				xfree(dir);
+				printwarn();
+				goto nochange;
+			}
+			if (jobstart(sel == SEL_DIFF ? JOB_DIFF : JOB_DIFFTREE,
+			    path, &name, 1, tmp) == -1)
+				unlink(tmp);
+			xfree(tmp);
+			xfree(dir);
+			break;
+		case SEL_HASHCOL:
+			showhash = !showhash;
+			if (showhash)
+				cksumload();
+			break;
+		case SEL_OWNERCOL:
+			showowner = !showowner;
+			/* Listed without ids, as remote mounts may be */
+			if (showowner && view == VIEW_DIR && n > 0 &&
+			    dentat(spill, dents, cur)->uid == (uid_t)-1) {
+				oldpath = mkpath(path, curname(buf));
+				goto begin;
+			}
+			break;
+		case SEL_TABNEW:
+			if (ntabs == MAXTABS) {
+				printmsg("Too many tabs");
+				goto nochange;
+			}
+			/* Same directory, or next to the archive */
+			tmp = view == VIEW_ARC ? xdirname(arcpath) : xstrdup(path);
+			tabsave(curtab);
+			othertab = curtab;
+			tabnew(tmp, ifilter);
+			goto begin;
+		case SEL_TABCLOSE:
+			if (ntabs == 1)
+				goto nochange;
+			tabsave(curtab);
+			if (othertab > curtab)
+				othertab--;
+			tabfree(&tabs[curtab]);
+			memmove(&tabs[curtab], &tabs[curtab + 1],
+			    (ntabs - curtab - 1) * sizeof(*tabs));
+			ntabs--;
+			curtab = MIN(curtab, ntabs - 1);
+			goto tabswitch;
+		case SEL_TABNEXT:
+		case SEL_TABPREV:
+			if (ntabs == 1)
+				goto nochange;
+			tabsave(curtab);
+			othertab = curtab;
+			curtab = (curtab + (sel == SEL_TABNEXT ? 1 : ntabs - 1)) %
+			    ntabs;
+tabswitch:
+			/* Shown as it was left unless a job changed things */
+			tabload(curtab);
+			if (!tabs[curtab].stale)
+				break;
+			tabs[curtab].stale = 0;
+			if (n > 0)
+				oldpath = mkpath(path, curname(buf));
+			goto begin;
+		case SEL_SPLIT:
+			split = !split;
+			if (!split || ntabs > 1)
+				break;
+			/* The other pane starts as a new tab on the same listing */
+			tmp = view == VIEW_ARC ? xdirname(arcpath) : xstrdup(path);
+			tabsave(curtab);
+			othertab = curtab;
+			tabnew(tmp, fltr);
+			goto begin;
+		case SEL_COMPARE:
+			cmpmode = !cmpmode;
+			cmpgen[0] = cmpgen[1] = 0;
+			break;
+		case SEL_JOBKILL:
+			/* Cancel the latest job and its workers */
+			for (i = njobs - 1; i >= 0; i--)
+				if (!JOBINTERNAL(jobs[i].op))
+					break;
+			/* Then those stuck filling in a listing */
+			if (i < 0)
+				i = njobs - 1;
+			if (i < 0) {
+				printmsg("No jobs");
+				goto nochange;
+			}
+			kill(-jobs[i].pid, SIGTERM);
+			break;
+		}
+		/* Names that came in show on the next draw */
+		if (idfd != -1)
+			idpoll();
+		/* Refresh the listing when a job finished */
+		if (njobs > 0 && jobpoll()) {
+			for (i = 0; i < ntabs; i++)
+				tabs[i].stale = i != curtab;
+			if (n > 0)
+				oldpath = mkpath(path, curname(buf));
+			if (populate() == -1) {
+				printwarn();
+				goto nochange;
+			}
+			redraw();
+			printmsg(jobmsg);
+			goto nochange;
 		}
 		/* Screensaver */
 		if (idletimeout != 0 && idle == idletimeout) {
@@ -976,6 +8101,9 @@ main(int argc, char *argv[])
 		usage(argv[0]);
 #ifdef DEBUG
 	fprintf(stderr, "Debugging on\n");
+	/* soak.sh drives debug builds through a FIFO of its own */
+	if (getenv("NOICE_REMOTE") != NULL)
+		remotefile = getenv("NOICE_REMOTE");
 #endif
 
 
@@ -1010,6 +8138,8 @@ main(int argc, char *argv[])
 	setlocale(LC_ALL, "");
 
 	initcurses();
+	remoteopen();
+	ctlopen();
 
 	browse(ipath, ifilter);
 
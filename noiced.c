@@ -0,0 +1,562 @@
+/* See LICENSE file for copyright and license details. */
+#define _GNU_SOURCE /* memfd_create(2) */
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/*
+ * noiced scans directories for noice and keeps the listings in sealed
+ * memfds, so every client maps the same pages.  A listing is scanned
+ * again when inotify reports a change, when the directory mtime moved,
+ * or after TTL seconds for filesystems where inotify does not see
+ * changes, like NFS.
+ *
+ * One daemon serves all users.  A client asks by sending the directory
+ * open, which proves it may read it, and listings are kept by device
+ * and inode.  Scans run in worker processes so one slow mount does not
+ * hold up the other clients.
+ */
+
+#define LEN(x) (sizeof(x) / sizeof(*(x)))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define NCACHE 256  /* Listings kept */
+#define NCLIENTS 64 /* Connections served at once */
+#define NWORKERS 8  /* Scans at once, clients scan on their own beyond */
+#define TTL 2       /* Seconds a listing is trusted without events */
+#define IDLE 1000   /* Milliseconds a client waits for its answer */
+#define WATCH (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+    IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct listing {
+	dev_t dev;
+	ino_t ino;
+	int fd;                /* Sealed memfd with the records, -1 if free */
+	int wd;                /* inotify watch or -1 */
+	struct timespec mtim;  /* Of the directory when scanned */
+	time_t scanned;
+	time_t used;
+};
+
+struct client {
+	int fd;
+	struct ucred cred;     /* Of the peer */
+	int dirfd;             /* Directory it asked for, -1 until then */
+	struct stat sb;        /* Of that directory */
+	long since;            /* When it was accepted, see msecs() */
+};
+
+/* A process scanning a directory for the clients asking for it */
+struct worker {
+	int fd;                /* The memfd comes back here, -1 if free */
+	int dirfd;
+	struct stat sb;
+};
+
+struct listing cache[NCACHE];
+struct client clients[NCLIENTS];
+struct worker workers[NWORKERS];
+int ifd = -1;
+
+void
+die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (fmt[0] != '\0' && fmt[strlen(fmt) - 1] == ':')
+		fprintf(stderr, " %s", strerror(errno));
+	fputc('\n', stderr);
+	exit(1);
+}
+
+/* Milliseconds on the monotonic clock */
+long
+msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void
+drop(struct listing *l)
+{
+	if (l->fd == -1)
+		return;
+	if (l->wd != -1)
+		inotify_rm_watch(ifd, l->wd);
+	close(l->fd);
+	l->fd = -1;
+}
+
+/* Send `fd' over `s' with the status `err', fd -1 sends none */
+void
+sendfd(int s, int fd, int err)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &err;
+	iov.iov_len = sizeof(err);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(&cmsg, 0, sizeof(cmsg));
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+		cmsg.h.cmsg_level = SOL_SOCKET;
+		cmsg.h.cmsg_type = SCM_RIGHTS;
+		cmsg.h.cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.h), &fd, sizeof(int));
+	}
+	sendmsg(s, &msg, MSG_NOSIGNAL);
+}
+
+/* Receive a status and the fd sent with it into `fd', -1 if none */
+ssize_t
+recvfd(int s, int *err, int *fd)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t r;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = err;
+	iov.iov_len = sizeof(*err);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	r = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+	if (r > 0 && msg.msg_controllen >= CMSG_LEN(sizeof(int)) &&
+	    cmsg.h.cmsg_level == SOL_SOCKET &&
+	    cmsg.h.cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(&cmsg.h), sizeof(int));
+	return r;
+}
+
+/* Write the listing of the directory open as `dir' to a sealed memfd */
+int
+scan(int dir)
+{
+	struct dentrec rec;
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	FILE *fp;
+	int fd, dfd, r = 0;
+
+	dirp = fdopendir(dir);
+	if (dirp == NULL)
+		return -1;
+	rewinddir(dirp);
+	fd = memfd_create("noiced", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		closedir(dirp);
+		return -1;
+	}
+	dfd = dup(fd);
+	fp = dfd != -1 ? fdopen(dfd, "w") : NULL;
+	if (fp == NULL) {
+		if (dfd != -1)
+			close(dfd);
+		close(fd);
+		closedir(dirp);
+		return -1;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0
+		    || strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd(dirp), dp->d_name, &sb,
+		    AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		memset(&rec, 0, sizeof(rec));
+		rec.mode = sb.st_mode;
+		rec.t = sb.st_mtime;
+		rec.tns = sb.st_mtim.tv_nsec;
+		rec.size = sb.st_size;
+		rec.dev = sb.st_dev;
+		rec.ino = sb.st_ino;
+		rec.uid = sb.st_uid;
+		rec.gid = sb.st_gid;
+		rec.len = strlen(dp->d_name);
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+		    fwrite(dp->d_name, 1, rec.len, fp) != rec.len) {
+			r = -1;
+			break;
+		}
+	}
+	closedir(dirp);
+	if (fclose(fp) == EOF)
+		r = -1;
+	/* Clients map pages that cannot change under them */
+	if (r == -1 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	    F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Return the fresh listing of the directory in `sb', NULL if there is none */
+struct listing *
+lookup(struct stat *sb)
+{
+	struct listing *l;
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	for (i = 0; i < NCACHE; i++) {
+		l = &cache[i];
+		if (l->fd == -1 || l->dev != sb->st_dev || l->ino != sb->st_ino)
+			continue;
+		if (now - l->scanned < TTL &&
+		    l->mtim.tv_sec == sb->st_mtim.tv_sec &&
+		    l->mtim.tv_nsec == sb->st_mtim.tv_nsec) {
+			l->used = now;
+			return l;
+		}
+		drop(l);
+	}
+	return NULL;
+}
+
+/* Keep the listing `fd' a worker made of `w->sb' */
+void
+store(struct worker *w, int fd)
+{
+	struct listing *l, *old = &cache[0];
+	char proc[64];
+	int i;
+
+	for (i = 0; i < NCACHE; i++) {
+		l = &cache[i];
+		if (l->fd != -1 && l->dev == w->sb.st_dev &&
+		    l->ino == w->sb.st_ino)
+			drop(l);
+		/* Free slots first, then the least recently used */
+		if (l->fd == -1 || (old->fd != -1 && l->used < old->used))
+			old = l;
+	}
+	drop(old);
+	old->dev = w->sb.st_dev;
+	old->ino = w->sb.st_ino;
+	old->fd = fd;
+	/* Watched through the directory the client sent */
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", w->dirfd);
+	old->wd = ifd != -1 ? inotify_add_watch(ifd, proc, WATCH) : -1;
+	old->mtim = w->sb.st_mtim;
+	old->scanned = old->used = time(NULL);
+}
+
+void
+hangup(struct client *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	if (c->dirfd != -1)
+		close(c->dirfd);
+	c->dirfd = -1;
+}
+
+/* Answer `c' with the memfd or the error and hang up, one per connection */
+void
+answer(struct client *c, int fd, int err)
+{
+	sendfd(c->fd, fd, err);
+	hangup(c);
+}
+
+/*
+ * Return 1 if the peer of `c' may see what is in its directory.  Having
+ * it open shows it may read the names, the sizes and times also take
+ * search permission.  Only the mode bits are looked at, so a client
+ * refused for want of a supplementary group or an ACL scans on its own.
+ */
+int
+searchable(struct client *c)
+{
+	mode_t m = c->sb.st_mode;
+	int fl;
+
+	fl = fcntl(c->dirfd, F_GETFL);
+	if (fl == -1 || (fl & O_PATH))
+		return 0;
+	if (c->cred.uid == 0)
+		return 1;
+	if (c->cred.uid == c->sb.st_uid)
+		return (m & S_IXUSR) != 0;
+	if (c->cred.gid == c->sb.st_gid)
+		return (m & S_IXGRP) != 0;
+	return (m & S_IXOTH) != 0;
+}
+
+/* Answer from the cache or have a worker scan, unless one already is */
+void
+request(struct client *c)
+{
+	struct listing *l;
+	struct worker *w;
+	int sv[2], i;
+	pid_t pid;
+
+	if (fstat(c->dirfd, &c->sb) == -1 || !S_ISDIR(c->sb.st_mode)) {
+		answer(c, -1, ENOTDIR);
+		return;
+	}
+	if (!searchable(c)) {
+		answer(c, -1, EACCES);
+		return;
+	}
+	l = lookup(&c->sb);
+	if (l != NULL) {
+		answer(c, l->fd, 0);
+		return;
+	}
+	for (i = 0; i < NWORKERS; i++) {
+		w = &workers[i];
+		/* The answer goes to every client waiting for it */
+		if (w->fd != -1 && w->sb.st_dev == c->sb.st_dev &&
+		    w->sb.st_ino == c->sb.st_ino)
+			return;
+	}
+	for (i = 0; i < NWORKERS; i++)
+		if (workers[i].fd == -1)
+			break;
+	/* Busy, the client scans on its own */
+	if (i == NWORKERS ||
+	    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		answer(c, -1, EAGAIN);
+		return;
+	}
+	w = &workers[i];
+	w->dirfd = dup(c->dirfd);
+	w->sb = c->sb;
+	pid = w->dirfd != -1 ? fork() : -1;
+	if (pid == 0) {
+		close(sv[0]);
+		i = scan(w->dirfd);
+		sendfd(sv[1], i, i == -1 ? errno != 0 ? errno : EIO : 0);
+		_exit(0);
+	}
+	close(sv[1]);
+	if (pid == -1) {
+		close(sv[0]);
+		if (w->dirfd != -1)
+			close(w->dirfd);
+		answer(c, -1, EAGAIN);
+		return;
+	}
+	w->fd = sv[0];
+}
+
+/* Take the listing a worker made and answer the clients waiting for it */
+void
+collect(struct worker *w)
+{
+	struct client *c;
+	int fd, err = EIO, i;
+
+	if (recvfd(w->fd, &err, &fd) <= 0)
+		err = EIO;
+	if (fd != -1)
+		store(w, fd);
+	for (i = 0; i < NCLIENTS; i++) {
+		c = &clients[i];
+		if (c->fd != -1 && c->dirfd != -1 &&
+		    c->sb.st_dev == w->sb.st_dev &&
+		    c->sb.st_ino == w->sb.st_ino)
+			answer(c, fd, fd != -1 ? 0 : err);
+	}
+	close(w->fd);
+	w->fd = -1;
+	close(w->dirfd);
+}
+
+/* Drop the listings inotify reported changes for */
+void
+events(void)
+{
+	char buf[4096]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t r;
+	char *p;
+	int i;
+
+	while ((r = read(ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + r; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			for (i = 0; i < NCACHE; i++)
+				if (cache[i].fd != -1 &&
+				    (cache[i].wd == ev->wd ||
+				    ev->mask & IN_Q_OVERFLOW))
+					drop(&cache[i]);
+		}
+	}
+}
+
+/* Read the request, a byte sent with the directory open */
+void
+serve(struct client *c)
+{
+	ssize_t r;
+	int err;
+
+	r = recvfd(c->fd, &err, &c->dirfd);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0 || c->dirfd == -1) {
+		hangup(c);
+		return;
+	}
+	request(c);
+}
+
+void
+usage(char *argv0)
+{
+	die("usage: %s socket", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pollfd pfds[2 + NCLIENTS + NWORKERS];
+	struct sockaddr_un sun;
+	struct client *c;
+	socklen_t len;
+	mode_t mask;
+	long now;
+	int s, fd, i, j, wait;
+
+	if (argc != 2)
+		usage(argv[0]);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof(sun.sun_path))
+		die("%s: path too long", argv[1]);
+	strlcpy(sun.sun_path, argv[1], sizeof(sun.sun_path));
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (s == -1)
+		die("socket:");
+	unlink(sun.sun_path);
+	/* Anyone may ask, each request shows it may read the directory */
+	mask = umask(0);
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		die("%s:", sun.sun_path);
+	umask(mask);
+	if (listen(s, SOMAXCONN) == -1)
+		die("listen:");
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	signal(SIGPIPE, SIG_IGN);
+	/* Workers are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+	for (i = 0; i < NCACHE; i++)
+		cache[i].fd = -1;
+	for (i = 0; i < NCLIENTS; i++)
+		clients[i].fd = clients[i].dirfd = -1;
+	for (i = 0; i < NWORKERS; i++)
+		workers[i].fd = -1;
+
+	for (;;) {
+		pfds[0].fd = s;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = ifd;
+		pfds[1].events = POLLIN;
+		/* Wake up for the first client to run out of time */
+		wait = -1;
+		now = msecs();
+		for (i = 0; i < NCLIENTS; i++) {
+			c = &clients[i];
+			/* Those waiting for a worker are not read */
+			pfds[2 + i].fd = c->dirfd == -1 ? c->fd : -1;
+			pfds[2 + i].events = POLLIN;
+			if (c->fd != -1 && (wait == -1 ||
+			    c->since + IDLE - now < wait))
+				wait = MAX(c->since + IDLE - now, 0);
+		}
+		for (i = 0; i < NWORKERS; i++) {
+			pfds[2 + NCLIENTS + i].fd = workers[i].fd;
+			pfds[2 + NCLIENTS + i].events = POLLIN;
+		}
+		if (poll(pfds, LEN(pfds), wait) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		if (pfds[1].revents & POLLIN)
+			events();
+		for (i = 0; i < NWORKERS; i++)
+			if (workers[i].fd != -1 &&
+			    pfds[2 + NCLIENTS + i].revents)
+				collect(&workers[i]);
+		for (i = 0; i < NCLIENTS; i++)
+			if (clients[i].fd != -1 && clients[i].dirfd == -1 &&
+			    pfds[2 + i].revents)
+				serve(&clients[i]);
+		/*
+		 * Those that keep quiet would lock everybody else out and
+		 * those still waiting have scanned on their own by now.  The
+		 * worker goes on and fills the cache.
+		 */
+		now = msecs();
+		for (i = 0; i < NCLIENTS; i++)
+			if (clients[i].fd != -1 &&
+			    now - clients[i].since >= IDLE)
+				hangup(&clients[i]);
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+		while ((fd = accept4(s, NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+			for (j = 0; j < NCLIENTS; j++)
+				if (clients[j].fd == -1)
+					break;
+			/* Busy, the client scans on its own */
+			len = sizeof(clients[j].cred);
+			if (j == NCLIENTS || getsockopt(fd, SOL_SOCKET,
+			    SO_PEERCRED, &clients[j].cred, &len) == -1) {
+				close(fd);
+				continue;
+			}
+			clients[j].fd = fd;
+			clients[j].dirfd = -1;
+			clients[j].since = msecs();
+		}
+	}
+}
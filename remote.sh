@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Replay remote control buttons into the FIFO noice reads.  Run noice
+# built with -DDEBUG as `noice 8>log' and pass the log to get the
+# average latency from a button read to its frame drawn.
+
+test $# -ge 1 || {
+    echo "usage: $0 fifo [count [log]]"
+    exit 1
+}
+
+fifo=$1
+count=${2:-100}
+log=$3
+test -p "$fifo" || mkfifo "$fifo" || exit 1
+
+i=0
+while [ $i -lt $count ]; do
+    case $((i % 4)) in
+    0|1) button=KEY_DOWN ;;
+    *) button=KEY_UP ;;
+    esac
+    printf '%016x 00 %s replay\n' $i $button
+    i=$((i + 1))
+    sleep 0.1
+done > "$fifo"
+
+test -n "$log" && awk '$1 == "input" { s += $2; n++ }
+    END { if (n) printf "%d buttons, %d us average\n", n, s / n }' "$log"
+exit 0
@@ -0,0 +1,65 @@
+#!/bin/sh
+
+# Enter the directory under the cursor and leave it again through the
+# FIFO noice reads remote control buttons from, and fail if the bytes
+# it has allocated keep growing from one cycle to the next.  Run noice
+# built with -DDEBUG as `noice 8>log' with the cursor on a directory,
+# or pass it with -x to have it run in a scratch directory under
+# script(1), reading buttons from the FIFO given in NOICE_REMOTE.
+
+noice=
+if [ "$1" = -x ]; then
+    noice=$2
+    shift 2
+fi
+test $# -ge 2 || {
+    echo "usage: $0 [-x noice] fifo log [cycles]"
+    exit 1
+}
+
+fifo=$1
+log=$2
+cycles=${3:-50}
+test "$cycles" -ge 3 || cycles=3
+test -p "$fifo" || mkfifo "$fifo" || exit 1
+
+if [ -n "$noice" ]; then
+    dir=$(mktemp -d) || exit 1
+    mkdir "$dir/d"
+    : > "$log"
+    NOICE_REMOTE=$fifo script -qec "$noice $dir 8>>$log" /dev/null \
+        < /dev/null > /dev/null 2>&1 &
+    pid=$!
+    trap 'kill $pid; rm -rf "$dir"' EXIT
+    sleep 1
+fi
+
+# Each listing read logs its live bytes, skip those from before
+skip=$(grep -c '^mem listing:' "$log")
+
+i=0
+while [ $i -lt $cycles ]; do
+    printf '%016x 00 KEY_RIGHT soak\n' $i
+    sleep 0.1
+    printf '%016x 00 KEY_LEFT soak\n' $i
+    sleep 0.1
+    i=$((i + 1))
+done > "$fifo"
+sleep 1
+
+# Two listings per cycle, the second back where it started.  The first
+# cycles fill the caches kept for the session.
+awk -v skip="$skip" -v cycles="$cycles" '
+$1 == "mem" && $2 == "listing:" { r++ }
+$1 == "mem" && r > skip { sub("live=", "", $3); live[r - skip] += $3 }
+END {
+    if (r - skip < 2 * cycles) {
+        printf "%d of %d listings logged\n", r - skip, 2 * cycles
+        exit 1
+    }
+    first = live[4]
+    last = live[2 * cycles]
+    printf "%d cycles, %d bytes live after the second, %d after the last\n",
+        cycles, first, last
+    exit last > first
+}' "$log"
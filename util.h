@@ -3,3 +3,27 @@
 size_t strlcat(char *, const char *, size_t);
 #undef strlcpy
 size_t strlcpy(char *, const char *, size_t);
+struct hash {
+	unsigned long long v[4];
+	unsigned long long total;
+	unsigned char mem[32];
+	size_t len;
+};
+void hashinit(struct hash *, unsigned long long);
+void hashupdate(struct hash *, const void *, size_t);
+unsigned long long hashfinal(struct hash *);
+/* Snapshot files start with this, bump it when dentrec changes */
+#define SNAPMAGIC "noice snapshot 2\n"
+/* Entry in view files and noiced(1) listings, followed by the name */
+struct dentrec {
+	mode_t mode;
+	char mark;
+	time_t t;
+	long tns;
+	unsigned long size;
+	dev_t dev;
+	ino_t ino;
+	uid_t uid;
+	gid_t gid;
+	size_t len;
+};